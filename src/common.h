@@ -14,6 +14,10 @@
 #  include <strings.h>
 #endif /*STDC_HEADERS*/
 
+#if HAVE_CTYPE_H
+#  include <ctype.h>
+#endif
+
 #if HAVE_UNISTD_H
 #  include <sys/types.h>
 #  include <unistd.h>
@@ -50,4 +54,16 @@
 # include <mysql.h>
 #endif
 
+#ifdef OLD_UCD_SNMP
+# include "asn1.h"
+# include "snmp_api.h"
+# include "snmp_impl.h"
+# include "snmp_client.h"
+# include "mib.h"
+# include "snmp.h"
+#else
+# include "net-snmp-config.h"
+# include "net-snmp-includes.h"
+#endif
+
 #endif /* RTG_COMMON_H */
@@ -17,7 +17,25 @@
 #endif
 
 /* Constants */
-#define MAX_THREADS 10
+#define MAX_WINDOW 4096
+#define ASYNC_FD_RESERVE 64
+#define SESSION_FD_RESERVE 64
+#define MAX_OIDS 128
+#define MAX_REPS 512
+#define MAX_DEFERRED 64
+#define HASH_CLOSED (1 << 30)	/* added to hash.bucket to end a round */
+#define THROTTLE_NAP 0.01
+#define MAX_BACKOFF 3600
+#define VARBIND_OVERHEAD 20
+#define BER_OID_MAX (MAX_OID_LEN * 5 + 4)
+#define NATIVE_BUFSIZE 65536
+#define NATIVE_SLOT_BITS 12	/* 1 << NATIVE_SLOT_BITS >= MAX_WINDOW */
+#define NATIVE_BATCH 32
+#define NATIVE_CONTROL (CMSG_SPACE(sizeof(unsigned int)) + CMSG_SPACE(sizeof(struct timespec)))
+#define URING_ENTRIES 64
+#define URING_BUFFERS 64	/* a power of two */
+#define PDU_OVERHEAD 40
+#define CACHE_LINE 64
 #define BUFSIZE 512
 #define BITSINBYTE 8
 #define THIRTYTWO 4294967295ul
@@ -32,23 +50,84 @@
 /* Defaults */
 #define DEFAULT_CONF_FILE "rtg.conf"
 #define DEFAULT_THREADS 5
+#define DEFAULT_THREADS_MIN 0
+#define DEFAULT_THREADS_MAX 0
 #define DEFAULT_INTERVAL 300
 #define DEFAULT_HIGHSKEWSLOP 3
 #define DEFAULT_LOWSKEWSLOP .5
+#define DEFAULT_SPREAD 0
+#define DEFAULT_LONGEST_FIRST FALSE
 #define DEFAULT_OUT_OF_RANGE 93750000000ull
 #define DEFAULT_DB_HOST "localhost"
 #define DEFAULT_DB_DB "rtg"
 #define DEFAULT_DB_USER "snmp"
 #define DEFAULT_DB_PASS "rtgdefault"
+#define DEFAULT_DB_SUBSECOND FALSE
+#define DEFAULT_DB_BATCH_ROWS 500
+#define DEFAULT_DB_BATCH_BYTES 65536
+#define DEFAULT_DB_BATCH_AGE 5
+#define DEFAULT_DB_WRITERS 2
+#define DEFAULT_DB_QUEUE 1024
+#define DEFAULT_DB_MODE DB_PREPARED
 #define DEFAULT_SNMP_VER 1
 #define DEFAULT_SNMP_PORT 161
+#define DEFAULT_ENGINE SYNC
+#define DEFAULT_WINDOW 256
+#define DEFAULT_MAX_OIDS 20
+#define DEFAULT_MAX_PDU 1400
+#define DEFAULT_MAX_REPS 0
+#define DEFAULT_DEV_INFLIGHT 0
+#define DEFAULT_DEV_GAP 0
+#define DEFAULT_SESSIONS 0
+#define DEFAULT_TIMEOUT 1000
+#define DEFAULT_MIN_TIMEOUT 100
+#define DEFAULT_RETRIES 5
+#define DEFAULT_FAIL_LIMIT 3
+#define DEFAULT_SNDBUF 0
+#define DEFAULT_RCVBUF 0
+#define DEFAULT_IO SOCKET_IO
+#define DEFAULT_LOG "stdout"
+#define DEFAULT_LOG_RATE 0
+
+/* Log rings: messages each thread may have waiting, longest message,
+   seconds between writes, and seconds a repeated message waits for
+   its count */
+#define LOG_SLOTS 256
+#define LOG_LINE 256
+#define LOG_NAP 0.02
+#define LOG_REPEAT 5
+
+/* Database connections: seconds idle before a ping, longest wait
+   between reconnects, and seconds to give up connecting, or waiting on
+   a read or write */
+#define DB_PING 30
+#define DB_BACKOFF_MAX 60
+#define DB_CONNECT_TIMEOUT 10
+#define DB_IO_TIMEOUT 60
+
+/* Prepared INSERTs: most kept per connection, and most rows in one
+   (the server allows 65535 placeholders, three to a row) */
+#define DB_STMT_CACHE 64
+#define DB_STMT_ROWS 21845
+
+/* Longest row, "(iid, FROM_UNIXTIME(secs.usecs), value)" and a comma,
+   or as a line to load */
+#define DB_ROW_MAX 80
 
 /* PID File */
 #define PIDFILE "/tmp/rtgpoll.pid"
 
 #define STAT_DESCRIP_ERROR 99
+/* Not sent: the device's circuit breaker is open */
+#define STAT_SKIPPED 98
 #define HASHSIZE 5000
 
+/* Batch outcomes returned by process_batch(), otherwise the index of a
+   failed varbind that should be dropped before retrying (GET) or the
+   number of targets done before the walk continues (GETBULK) */
+#define BATCH_DONE (-1)
+#define BATCH_SPLIT (-2)
+
 /* pthread error messages */
 #define PML_ERR "pthread_mutex_lock error\n"
 #define PMU_ERR "pthread_mutex_unlock error\n"
@@ -61,17 +140,107 @@
 #define PT_COND_WAIT(x,y) if (pthread_cond_wait(x, y) != 0) printf(PCW_ERR);
 #define PT_COND_BROAD(x) if (pthread_cond_broadcast(x) != 0) printf(PCB_ERR);
 
+/* Atomic add, returns the old value.  Falls back to a mutex on
+   compilers without the GCC __sync builtins. */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+# define ATOMIC_ADD(x,n) __sync_fetch_and_add((x), (n))
+#else
+# define ATOMIC_ADD(x,n) atomic_add((x), (n))
+#endif
+
+/* A worker's counters are only changed by the worker, with COUNT(), and
+   may be read by any thread with COUNTED() while it runs.  Neither
+   needs a lock or a locked instruction; the relaxed atomics just keep
+   each read and write whole. */
+#if defined(__ATOMIC_RELAXED)
+# define COUNT(x,n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+# define COUNTED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#else
+# define COUNT(x,n) ((x) += (n))
+# define COUNTED(x) (x)
+#endif
+#if defined(__GNUC__)
+# define CACHE_ALIGNED __attribute__ ((aligned (CACHE_LINE)))
+#else
+# define CACHE_ALIGNED
+#endif
+
 /* Verbosity levels LOW=info HIGH=info+SQL DEBUG=info+SQL+junk */
 enum debugLevel {OFF, LOW, HIGH, DEBUG, DEVELOP}; 
 
 /* Target state */
 enum targetState {NEW, LIVE, STALE};
 
+/* Poll engines: SYNC=one blocking request per thread, ASYNC=a window of
+   outstanding requests per thread, NATIVE=like ASYNC but GETs are
+   encoded and decoded by rtgpoll itself */
+enum pollEngine {SYNC, ASYNC, NATIVE};
+
+/* How the native engine moves datagrams: SOCKET_IO=sendmmsg/recvmmsg
+   on its socket, URING_IO=through an io_uring where the kernel has one */
+enum nativeIO {SOCKET_IO, URING_IO};
+
+/* How the database writers insert: DB_INSERT=multi-row INSERTs sent as
+   text, DB_PREPARED=the same through prepared statements, with the
+   values sent binary, DB_LOAD=LOAD DATA LOCAL INFILE from memory */
+enum dbMode {DB_INSERT, DB_PREPARED, DB_LOAD};
+
+/* How a target's poll turned out, as counted in its worker's shard:
+   answered, no response (timed out, or skipped by the breaker), or an
+   error (no session, a failed request, an error status, a missing
+   varbind, or noSuchObject and the like) */
+enum pollResult {RESULT_OK, RESULT_TIMEOUT, RESULT_SKIPPED, RESULT_DESCRIP,
+    RESULT_FAILED, RESULT_ERRSTAT, RESULT_MISSING, RESULT_NOSUCH, RESULTS};
+
+/* Where a worker's time goes: waiting on the network, in database
+   inserts (the lock included) and idle between rounds */
+enum pollPhase {PHASE_SNMP, PHASE_DB, PHASE_IDLE, PHASES};
+
 /* Typedefs */
+/* A worker's counts for one interval class since the last reload */
+typedef struct tally_struct {
+    unsigned long long polls;
+    unsigned long long db_inserts;
+    unsigned long long no_resp;
+    unsigned long long errors;
+} tally_t;
+
+/* The statistics shard of worker index, or of a database writer; see
+   COUNT().  A worker's outlives it and passes to the next one with its
+   index.  bytes_sent and bytes_received are the native engine's
+   datagrams; retries are requests sent again, after a timeout or a
+   split.  db_dropped are rows a worker found no room for in the
+   database queue.  usecs are spent in each pollPhase.  tally[] has one
+   per interval class, and is folded into the classes on a reload. */
+typedef struct counters_struct {
+    unsigned long long results[RESULTS];
+    unsigned long long db_inserts;
+    unsigned long long db_dropped;
+    unsigned long long wraps;
+    unsigned long long out_of_range;
+    unsigned long long abandoned;
+    unsigned long long stragglers;
+    unsigned long long sent;
+    unsigned long long received;
+    unsigned long long drops;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    unsigned long long retries;
+    unsigned long long usecs[PHASES];
+    tally_t *tally;
+    int ntally;
+} CACHE_ALIGNED counters_t;
+
 typedef struct worker_struct {
     int index;
     pthread_t thread;
     struct crew_struct *crew;
+    counters_t *counters;
+    struct logring_struct *log;
+    struct dbbuf_struct *dbbufs;
+    double db_since;
+    unsigned int inflight;
+    int round;
 } worker_t;
 
 typedef struct config_struct {
@@ -81,6 +250,13 @@ typedef struct config_struct {
     char dbdb[80];
     char dbuser[80];
     char dbpass[80];
+    unsigned short dbsubsecond;
+    unsigned int db_batch_rows;
+    unsigned int db_batch_bytes;
+    unsigned int db_batch_age;
+    unsigned short db_writers;
+    int db_queue;
+    enum dbMode db_mode;
     enum debugLevel verbose;
     unsigned short withzeros;
     unsigned short dboff;
@@ -88,13 +264,38 @@ typedef struct config_struct {
     unsigned short snmp_ver;
     unsigned short snmp_port;
     unsigned short threads;
+    unsigned short threads_min;
+    unsigned short threads_max;
+    enum pollEngine engine;
+    unsigned int window;
+    unsigned short max_oids;
+    unsigned short max_pdu;
+    unsigned short max_reps;
+    unsigned short dev_inflight;
+    unsigned int dev_gap;
+    unsigned int sessions;
+    unsigned int timeout;
+    unsigned int min_timeout;
+    unsigned short retries;
+    unsigned short fail_limit;
+    unsigned int sndbuf;
+    unsigned int rcvbuf;
+    enum nativeIO io;
     float highskewslop;
     float lowskewslop;
+    float spread;
+    unsigned short longest_first;
+    char log[BUFSIZE];
+    unsigned int log_rate;
 } config_t;
 
 typedef struct target_struct {
     char host[64];
     char objoid[128];
+    oid *anOID;
+    size_t anOID_len;
+    u_char *ber;
+    unsigned short ber_len;
     unsigned short bits;
     char community[64];
     char table[64];
@@ -106,63 +307,561 @@ typedef struct target_struct {
 #endif
     enum targetState init;
     unsigned long long last_value;
+    unsigned long instance;
+    unsigned short collen;
+    unsigned int interval;
+    struct iclass_struct *iclass;
+    struct device_struct *device;
+    struct target_struct *dnext;
     struct target_struct *next;
 } target_t;
 
+/* Cached SNMP sessions for one host/community/port/version.  idle is
+   oldest first.  Entries with idle sessions are also on a list, newer
+   and older, most recently used first. */
+typedef struct session_struct {
+    char host[64];
+    char community[64];
+    unsigned short port;
+    unsigned short version;
+    void **idle;
+    int nidle;
+    int maxidle;
+    int busy;
+    int live;
+    struct session_struct *newer;
+    struct session_struct *older;
+    struct session_struct *next;
+} session_t;
+
+/* A device is a host/community pair; its targets are polled together.
+   If maxinflight or mingap (ms) is set, requests to it are paced.  srtt
+   and rttvar (seconds) set its request timeout; after set.fail_limit
+   timeouts in a row its circuit breaker opens and one request per
+   backoff seconds is let through, from retry_at on.  loss is a moving
+   average of the share of its requests that time out.  pace guards
+   everything from inflight through loss.  due counts its batches in
+   the round being queued.  addr is where the native engine sends to,
+   if native is set. */
+typedef struct device_struct {
+    char host[64];
+    char community[64];
+    unsigned short port;
+    unsigned short version;
+    session_t *session;
+    struct sockaddr_in addr;
+    int native;
+    unsigned short maxoids;
+    unsigned short maxreps;
+    unsigned short maxinflight;
+    unsigned int mingap;
+    pthread_mutex_t pace;
+    unsigned int inflight;
+    double next_send;
+    double srtt;
+    double rttvar;
+    unsigned int timeouts;
+    unsigned int backoff;
+    double retry_at;
+    double probe_at;
+    double loss;
+    int due;
+    enum targetState init;
+    unsigned int targets;
+    target_t *list;
+    target_t *cursor;
+    struct device_struct *next;
+} device_t;
+
+/* Per-host options from "device" lines in the target file */
+typedef struct devopt_struct {
+    char host[64];
+    char opts[BUFSIZE];
+    struct devopt_struct *next;
+} devopt_t;
+
+/* Targets on one device fetched with a single multi-varbind GET, or
+   rows of one column fetched by a GETBULK walk with max-repetitions
+   bulk.  The batch is due in the rounds of its interval class's wheel
+   slot, offset seconds after the round starts, and was due at due
+   when last claimed.  pending counts its targets claimed in round and
+   not yet done, and is only changed atomically; a batch still pending
+   is not claimed again.  rank is
+   how long its device is expected to take over it and the batches
+   after it in the round. */
+typedef struct batch_struct {
+    device_t *device;
+    target_t **targets;
+    unsigned short count;
+    unsigned short bulk;
+    int slot;
+    double offset;
+    double due;
+    int pending;
+    int round;
+    double rank;
+} batch_t;
+
+/* Targets polled every interval seconds.  Rounds start every hash.tick
+   seconds; each class is a timer wheel of interval / hash.tick slots,
+   one per round, and its batches in slot s (batches[first[s]] up to
+   batches[first[s + 1]]) are due in every round r with r % slots == s.
+   The counters run up to the last reload; counts since are in the
+   workers' shards. */
+typedef struct iclass_struct {
+    unsigned int interval;
+    int slots;
+    int *first;
+    batch_t *batches;
+    int nbatches;
+    int ntargets;
+    unsigned long long polls;
+    unsigned long long db_inserts;
+    unsigned int no_resp;
+    unsigned int errors;
+    unsigned int rounds;
+} iclass_t;
+
+/* main() starts round generation by waking the workers on go.  The
+   round ends once work_count, the targets due and not yet done, drops
+   to zero or, failing that, when the next round is due: it is closed,
+   what nobody claimed is abandoned and work under way is left to
+   finish while the next round runs.  main() hears on done when
+   work_count reaches zero and when the last of the busy workers goes
+   idle.  Batches are claimed with ATOMIC_ADD on hash.bucket, and
+   work_count and closed, the last round cut off, only change
+   atomically.  The crew is resized between
+   rounds: workers with index >= nthreads leave when they next look for
+   a round. */
 typedef struct crew_struct {
     int work_count;
-    worker_t member[MAX_THREADS];
+    worker_t **member;
+    int nthreads;
+    int running;
     pthread_mutex_t mutex;
-    pthread_cond_t done;
     pthread_cond_t go;
+    pthread_cond_t done;
+    int busy;
+    unsigned int generation;
+    int closed;
 } crew_t;
 
+/* main()'s own statistics.  The polling counts are in the shards, one
+   per worker index ever started (workers[index]) and one per database
+   writer, and are summed when read; only main() adds shards, and
+   main() and reloads (which hold reload_mutex) are the only ones to
+   walk them.  mutex guards late.  db_depth and db_peak are copied from
+   the database queue for print_stats(), with the rows the writers have
+   written since it last ran and the time they took. */
 typedef struct poll_stats {
     pthread_mutex_t mutex;
-    unsigned long long polls;
-    unsigned long long db_inserts;
     unsigned int round;
-    unsigned int wraps;
-    unsigned int no_resp;
-    unsigned int out_of_range;
-    unsigned int errors;
     unsigned int slow;
     double poll_time; 
+    unsigned long long abandoned;
+    double late;
+    double longest;
+    double total_time;
+    counters_t **shards;
+    int nshards;
+    counters_t **workers;
+    int nworkers;
+    int db_depth;
+    int db_peak;
+    unsigned long long db_rows;
+    double db_time;
 } stats_t;
 
+/* A thread's log ring.  Only the thread moves head and only the log
+   thread moves tail, each with ATOMIC_ADD once the slot is written or
+   read; both run modulo 2 * LOG_SLOTS.  lost counts messages that
+   found the ring full, reported those already logged. */
+typedef struct logline_struct {
+    double when;
+    char text[LOG_LINE];
+} logline_t;
+
+typedef struct logring_struct {
+    logline_t line[LOG_SLOTS];
+    int head;
+    int tail;
+    unsigned long long lost;
+    unsigned long long reported;
+} logring_t;
+
+/* The log thread's state, all guarded by mutex.  rings[] has one per
+   worker index ever started.  last is the last message written out,
+   repeated repeats times since repeat_at; count were written in second,
+   and dropped were over LogRate. */
+typedef struct logger_struct {
+    pthread_mutex_t mutex;
+    pthread_key_t key;
+    int on;
+    int syslog;
+    FILE *fp;
+    logring_t **rings;
+    int nrings;
+    char last[LOG_LINE];
+    char text[LOG_LINE];
+    int repeats;
+    double repeat_at;
+    long second;
+    unsigned int count;
+    unsigned int dropped;
+} logger_t;
+
+/* A row waiting to be inserted: value, polled at time received, for
+   target iid in interval class iclass.  In DB_INSERT mode its text
+   starts at sql + at in its buffer. */
+typedef struct dbrow_struct {
+    unsigned long long value;
+    double received;
+    size_t at;
+    int iid;
+    int iclass;
+} dbrow_t;
+
+/* Rows a worker has waiting to be inserted into table.  In DB_INSERT
+   mode they are also kept as one multi-row INSERT in sql, whose
+   statement up to VALUES is head bytes long.  since is when the first
+   row was added.  A worker hands the buffer to the database queue
+   whole, and a writer frees it. */
+typedef struct dbbuf_struct {
+    char table[64];
+    char *sql;
+    size_t len;
+    size_t size;
+    size_t head;
+    dbrow_t *row;
+    int rows;
+    int maxrows;
+    double since;
+    unsigned int generation;
+    struct dbbuf_struct *next;
+} dbbuf_t;
+
+/* The database queue: workers append buffers to it and never wait on
+   the database; with set.db_queue buffers waiting a worker drops its
+   rows instead.  Writers take them from the front, each inserting
+   through its own connection.  generation goes up on every reload,
+   and a buffer queued before it is no longer counted by class.  peak
+   is the most waiting since the statistics were last printed, and
+   rows and usecs the writers' totals then. */
+typedef struct dbqueue_struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    dbbuf_t *head;
+    dbbuf_t *tail;
+    int depth;
+    int peak;
+    unsigned int generation;
+    unsigned long long rows;
+    unsigned long long usecs;
+} dbqueue_t;
+
+/* A prepared INSERT of rows rows into table.  bind points into param,
+   so it is bound once and each execute only copies the values in. */
+typedef struct dbparam_struct {
+    unsigned long long value;
+    double received;
+    long long secs;
+    int iid;
+} dbparam_t;
+
+typedef struct dbstmt_struct {
+    char table[64];
+    int rows;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND *bind;
+    dbparam_t *param;
+    struct dbstmt_struct *next;
+} dbstmt_t;
+
+/* A LOAD DATA LOCAL INFILE of rows rows from row under way: the next
+   one to go, and the line being read, len bytes long, at bytes of which
+   have gone */
+typedef struct dbload_struct {
+    dbrow_t *row;
+    int rows;
+    int next;
+    char line[DB_ROW_MAX];
+    unsigned int len;
+    unsigned int at;
+} dbload_t;
+
+/* A database writer.  worker only gives it an index, a shard and a
+   thread; it takes part in no rounds.  stmts are the nstmts statements
+   prepared on its connection, most recently used first.  While its
+   connection is down it tries again at retry_at, backoff seconds after
+   the last try. */
+typedef struct dbwriter_struct {
+    worker_t worker;
+    MYSQL mysql;
+    dbstmt_t *stmts;
+    int nstmts;
+    int up;
+    int backoff;
+    double retry_at;
+} dbwriter_t;
+
+/* Async engine: one SNMP session per device per thread, shared by all
+   of that thread's requests in flight to the device and checked out of
+   the session cache */
+typedef struct async_session_struct {
+    device_t *device;
+    session_t *entry;
+    void *sessp;
+    unsigned int inflight;
+    struct async_session_struct *next;
+} async_session_t;
+
+typedef struct async_request_struct {
+    worker_t *worker;
+    async_session_t *session;
+    batch_t *batch;
+    target_t **targets;
+    int count;
+    int bulk;
+    double sent;
+} async_request_t;
+
+/* Native engine: a GET in flight on a thread's UDP socket.  The low
+   NATIVE_SLOT_BITS of its request-id are its index in req[], so a
+   response finds its request without a search. */
+typedef struct native_request_struct {
+    batch_t *batch;
+    long reqid;
+    unsigned short tries;
+    double sent;
+    double expires;
+} native_request_t;
+
+/* Requests are encoded into out and sent NATIVE_BATCH at a time;
+   outreq[i] was encoded into outiov[i].  in holds NATIVE_BATCH
+   received datagrams.  drops is the socket's count of datagrams the
+   kernel dropped for want of buffer space, as last reported. */
+typedef struct native_struct {
+    worker_t *worker;
+    int sock;
+    native_request_t *req;
+    int next;
+    unsigned long serial;
+    u_char *out;
+    size_t outlen;
+    int nout;
+    native_request_t *outreq[NATIVE_BATCH];
+    struct iovec *outiov;
+    u_char *in;
+    unsigned int drops;
+    struct uring_struct *uring;
+} native_t;
+
+/* A native engine thread's io_uring.  The socket is the ring's one
+   registered file.  A multishot recvmsg takes buffers from bufs
+   through the registered buffer ring bufring; answers it posts while
+   a flush waits for its sends are kept in ready[] until the next
+   drain.  msgs[] holds the headers of the sends in flight, then the
+   one the receive is armed with. */
+typedef struct uring_struct {
+    int fd;
+    void *sq_map;
+    size_t sq_maplen;
+    void *cq_map;
+    size_t cq_maplen;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *sqes;
+    size_t sqes_len;
+    void *cqes;
+    void *bufring;
+    u_char *bufs;
+    unsigned short buftail;
+    int armed;
+    struct msghdr *msgs;
+    unsigned short readybid[URING_BUFFERS];
+    int readylen[URING_BUFFERS];
+    int nready;
+} uring_t;
+
+/* The target hash and the round's queue, due, which is open to claims
+   from the crew's generation round only and is claimed from by
+   ATOMIC_ADD on bucket; claiming counts the claims under way. */
 typedef struct hash_struct {
     target_t *table[HASHSIZE];
+    device_t *devices[HASHSIZE];
+    batch_t *batches;
+    target_t **members;
+    int nbatches;
+    int ntargets;
+    iclass_t *classes;
+    int nclasses;
+    unsigned int tick;
+    unsigned int rounds;
+    batch_t **due;
+    int ndue;
     int bucket;
-    target_t *target;
+    int claiming;
+    int round;
+    double start;
 } hash_t;
 
 
 /* Precasts: rtgpoll.c */
 void *sig_handler(void *);
+int round_wait(worker_t *);
+void round_start(crew_t *, int);
+int round_started(worker_t *);
+int round_end(crew_t *, int, double);
+void round_close(crew_t *);
+void crew_resize(crew_t *, int);
+double next_round(double, unsigned int *);
 void usage(char *);
 
-/* Precasts: rtgpoll.c */
+/* Precasts: rtgsnmp.c */
 void *poller(void *);
+void poll_sync(worker_t *, batch_t *);
+int target_oid(target_t *);
+void poll_batch(worker_t *, void *, target_t **, int, int);
+void target_done(worker_t *, batch_t *, int);
+void target_abandon(worker_t *, batch_t *);
+void work_done(crew_t *, int);
+struct snmp_pdu *batch_pdu(target_t **, int, int);
+int process_batch(worker_t *, target_t **, int, int, int, struct snmp_pdu *, double);
+int process_walk(worker_t *, target_t **, int, int, struct snmp_pdu *, double);
+int snmp_value(target_t *, struct variable_list *, unsigned long long *);
+void process_result(worker_t *, target_t *, int, struct snmp_pdu *, struct variable_list *, double);
+void process_value(worker_t *, target_t *, unsigned long long, double);
+void process_values(worker_t *, target_t **, int, unsigned long long *, double);
+
+/* Precasts: rtgasync.c */
+async_session_t *async_session(async_session_t **, int *, device_t *);
+int async_send(worker_t *, async_session_t *, batch_t *, target_t **, int, int);
+int async_resend(worker_t *, async_session_t *, batch_t *, target_t **, int, int);
+int async_close_idle(async_session_t **);
+int async_response(int, struct snmp_session *, int, struct snmp_pdu *, void *);
+void *async_poller(void *);
+
+/* Precasts: rtgber.c */
+u_char *ber_put_header(u_char *, u_char, size_t);
+u_char *ber_put_int(u_char *, unsigned long);
+int ber_oid(u_char *, size_t, oid *, size_t);
+u_char *ber_get(u_char *, size_t, device_t *, long, target_t **, int, size_t *);
+int ber_header(const u_char **, const u_char *, u_char *, size_t *);
+int ber_get_int(const u_char *, size_t, long *);
+int ber_get_uint(const u_char *, size_t, unsigned long long *);
+int ber_field(const u_char **, const u_char *, long *);
+int ber_response(const u_char *, size_t, long *, long *, const u_char **, size_t *);
+int ber_values(const u_char *, size_t, target_t **, int, unsigned long long *);
+
+/* Precasts: rtgnative.c */
+int native_addr(device_t *);
+int native_socket();
+void native_fallback(native_t *, batch_t *);
+void native_failed(native_t *, native_request_t *, int);
+void native_flush(native_t *);
+int native_transmit(native_t *, native_request_t *);
+int native_send(native_t *, batch_t *);
+void native_receive(native_t *, const u_char *, size_t, struct sockaddr_in *, double);
+void native_control(struct msghdr *, unsigned int *, double *);
+int native_drain(native_t *);
+void native_count(native_t *, int, unsigned int);
+double native_expire(native_t *, double);
+void *native_poller(void *);
+
+/* Precasts: rtguring.c */
+struct io_uring_sqe;
+struct io_uring_cqe;
+int uring_enter(uring_t *, unsigned int, unsigned int);
+struct io_uring_sqe *uring_sqe(uring_t *);
+void uring_recycle(uring_t *, int);
+void uring_arm(uring_t *);
+int uring_cqe(uring_t *, struct io_uring_cqe *);
+void uring_received(uring_t *, struct io_uring_cqe *);
+void uring_close(uring_t *);
+uring_t *uring_open(int);
+int uring_send(native_t *, int, int *);
+int uring_drain(native_t *);
+
+/* Precasts: rtgdb.c */
+dbbuf_t *db_buffer(worker_t *, char *);
+void db_queue(worker_t *, target_t *, unsigned long long, double);
+void db_post(worker_t *, dbbuf_t *);
+void db_flush(worker_t *, int);
+void db_free(dbbuf_t *);
+int db_start();
+int db_connect(dbwriter_t *);
+void db_lost(dbwriter_t *);
+void *db_writer(void *);
+int db_write(dbwriter_t *, dbbuf_t *);
+int db_write_sql(dbwriter_t *, dbbuf_t *);
+int db_write_prepared(dbwriter_t *, dbbuf_t *);
+int db_write_load(dbwriter_t *, dbbuf_t *);
+void db_written(dbwriter_t *, dbbuf_t *, int, int);
+void db_trim(dbbuf_t *, int);
+void db_hold();
+void db_release();
+void db_stats();
 
 /* Precasts: rtgmysql.c */
 int db_insert(char *, MYSQL *);
 int rtg_dbconnect(char *, MYSQL *);
 void rtg_dbdisconnect(MYSQL *);
+dbstmt_t *db_prepare(MYSQL *, dbstmt_t **, int *, char *, int);
+int db_execute(dbstmt_t *, dbrow_t *);
+void db_unprepare(dbstmt_t **, int *);
+void db_stmt_free(dbstmt_t *);
+int db_load(MYSQL *, char *, dbrow_t *, int);
+int db_infile_init(void **, const char *, void *);
+int db_infile_read(void *, char *, unsigned int);
+void db_infile_end(void *);
+int db_infile_error(void *, char *, unsigned int);
 
 /* Precasts: rtgutil.c */
 int read_rtg_config(char *, config_t *);
 int write_rtg_config(char *, config_t *);
 void config_defaults(config_t *);
 void print_stats (stats_t);
-void sleepy(float);
+counters_t *counters_new();
+counters_t *counters_get(int);
+void counters_sum(counters_t *);
+void counters_fold(iclass_t *, int);
+tally_t *count_tally(worker_t *, target_t *);
+void count_time(worker_t *, int, double);
+double time_now();
+double clock_now();
+double next_boundary(unsigned int);
+void nap_until(double);
+void sleep_until(double);
 void timestamp(char *);
 int checkPID(char *);
 int alldigits(char *);
+int atomic_add(int *, int);
+int scale_threads(int, double);
+
+/* Precasts: rtglog.c */
+void log_init();
+logring_t *log_ring(int);
+void log_attach(logring_t *);
+void rtglog(const char *, ...);
+void *log_thread(void *);
+void log_flush();
+void log_drain();
+void log_emit(double, const char *);
+void log_repeats();
+void log_out(double, const char *);
 
 /* Precasts: rtghash.c */
 void init_hash();
-void init_hash_walk();
-target_t *getNext();
+int init_hash_walk(double);
+void open_hash_walk(int);
+int close_hash_walk();
+int compare_due(const void *, const void *);
+batch_t *getNext(int, double *);
 void free_hash();
 unsigned long make_key(const void *);
 void mark_targets(int);
@@ -174,9 +873,49 @@ int del_hash_entry(target_t *);
 int add_hash_entry(target_t *);
 int hash_target_file(char *);
 
+/* Precasts: rtgdevice.c */
+unsigned long device_key(const char *, const char *);
+device_t *find_device(const char *, const char *);
+int device_options(device_t *, char *, int);
+devopt_t *find_devopt(devopt_t *, const char *);
+void free_devopts(devopt_t *);
+void build_devices(devopt_t *);
+int walk_column(target_t *);
+int compare_walk(const void *, const void *);
+void sort_walks(device_t *);
+void build_batches();
+iclass_t *find_class(iclass_t *, int, unsigned int);
+void build_classes();
+double spread_phase(target_t *);
+int compare_offset(const void *, const void *);
+void build_wheels();
+int device_claim(device_t *, double, double *);
+void device_charge(device_t *);
+void device_release(device_t *);
+double device_rto(device_t *);
+double device_timeout(device_t *, void *);
+int device_up(device_t *, double);
+void device_result(device_t *, int, double);
+batch_t *claim_batch(worker_t *, batch_t **, int *, int *, double *);
+void claim_late(batch_t *, double);
+double device_cost(device_t *, double);
+void rank_batches(batch_t **, int);
+
+/* Precasts: rtgsession.c */
+void init_sessions();
+unsigned long session_key(const char *, const char *, unsigned short, unsigned short);
+session_t *find_session(device_t *);
+void *session_open(session_t *);
+void *session_get(device_t *, session_t **);
+void session_put(session_t *, void *);
+void session_used(session_t *);
+void session_unused(session_t *);
+int session_evict();
+void session_sweep();
+
 /* Globals */
 config_t set;
-int lock;
+/* SIGHUPs received during a round, not yet acted on */
 int waiting;
 char config_paths[CONFIG_PATHS][BUFSIZE];
 hash_t hash;
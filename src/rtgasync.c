@@ -0,0 +1,306 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG asynchronous SNMP poll engine
+****************************************************************************/
+
+#include "common.h"
+#include "rtg.h"
+#include <errno.h>
+
+#ifdef OLD_UCD_SNMP
+# define NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE RECEIVED_MESSAGE
+# define NETSNMP_CALLBACK_OP_TIMED_OUT TIMED_OUT
+#endif
+
+extern int sessions_max;
+
+
+/* Return this thread's session to device, checking one out of the
+   cache if needed.  NULL if the session could not be opened. */
+async_session_t *async_session(async_session_t **sessions, int *nsessions, device_t *device)
+{
+    async_session_t *as = NULL;
+
+    for (as = *sessions; as; as = as->next) {
+	if (as->device == device)
+	    return as;
+    }
+
+    as = (async_session_t *) malloc(sizeof(async_session_t));
+    if (!as) {
+	printf("Fatal async session malloc error!\n");
+	exit(-1);
+    }
+    as->device = device;
+    if ((as->sessp = session_get(device, &(as->entry))) == NULL) {
+	free(as);
+	return NULL;
+    }
+    as->inflight = 0;
+    as->next = *sessions;
+    *sessions = as;
+    (*nsessions)++;
+    return as;
+}
+
+
+/* Send a GET (or a GETBULK walk if bulk > 0) for count of batch's
+   targets.  targets is copied into the request so split retries can
+   send any subset.  Returns FALSE if nothing was sent, in which case
+   the targets have already been failed. */
+int async_send(worker_t *worker, async_session_t *as, batch_t *batch, target_t **targets, int count, int bulk)
+{
+    async_request_t *req = NULL;
+    struct snmp_pdu *pdu = NULL;
+    int i;
+
+    req = (async_request_t *) malloc(sizeof(async_request_t) + count * sizeof(target_t *));
+    if (!req) {
+	printf("Fatal async request malloc error!\n");
+	exit(-1);
+    }
+    req->worker = worker;
+    req->session = as;
+    req->batch = batch;
+    req->targets = (target_t **) (req + 1);
+    req->count = count;
+    req->bulk = bulk;
+    memcpy(req->targets, targets, count * sizeof(target_t *));
+
+    pdu = batch_pdu(targets, count, bulk);
+    device_timeout(as->device, as->sessp);
+    req->sent = time_now();
+    if (snmp_sess_async_send(as->sessp, pdu, async_response, req) == 0) {
+	snmp_free_pdu(pdu);
+	free(req);
+	for (i = 0; i < count; i++)
+	    process_result(worker, targets[i], STAT_ERROR, NULL, NULL, 0);
+	target_done(worker, batch, count);
+	return FALSE;
+    }
+    as->inflight++;
+    worker->inflight++;
+    return TRUE;
+}
+
+
+/* Return every session that has nothing in flight to the cache.
+   Returns the number of sessions still held. */
+int async_close_idle(async_session_t **sessions)
+{
+    async_session_t *as = NULL;
+    async_session_t *prev = NULL;
+    async_session_t *next = NULL;
+    int open = 0;
+
+    for (as = *sessions; as; as = next) {
+	next = as->next;
+	if (as->inflight == 0) {
+	    session_put(as->entry, as->sessp);
+	    if (prev)
+		prev->next = next;
+	    else
+		*sessions = next;
+	    free(as);
+	} else {
+	    prev = as;
+	    open++;
+	}
+    }
+    return open;
+}
+
+
+/* Send a follow-up request for a batch whose device slot is already
+   held, counting it against the device's in-flight limit */
+int async_resend(worker_t *worker, async_session_t *as, batch_t *batch, target_t **targets, int count, int bulk)
+{
+    device_charge(as->device);
+    if (!async_send(worker, as, batch, targets, count, bulk)) {
+	device_release(as->device);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* net-snmp callback: a response arrived or the request timed out */
+int async_response(int operation, struct snmp_session *sp, int reqid,
+		   struct snmp_pdu *response, void *magic)
+{
+    async_request_t *req = (async_request_t *) magic;
+    worker_t *worker = req->worker;
+    target_t *retry[MAX_OIDS];
+    int status, outcome, i, n;
+
+    if (operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE)
+	status = STAT_SUCCESS;
+    else if (operation == NETSNMP_CALLBACK_OP_TIMED_OUT)
+	status = STAT_TIMEOUT;
+    else
+	status = STAT_ERROR;
+
+    req->session->inflight--;
+    worker->inflight--;
+    device_release(req->session->device);
+    device_result(req->session->device, status, req->sent);
+
+    /* response is owned and freed by the library */
+    outcome = process_batch(worker, req->targets, req->count, req->bulk, status, response, time_now());
+    if (outcome == BATCH_DONE) {
+	target_done(worker, req->batch, req->count);
+    } else if (outcome == BATCH_SPLIT) {
+	n = req->count / 2;
+	COUNT(worker->counters->retries, 2);
+	async_resend(worker, req->session, req->batch, req->targets, n, req->bulk);
+	async_resend(worker, req->session, req->batch, req->targets + n, req->count - n, req->bulk);
+    } else if (req->bulk) {
+	target_done(worker, req->batch, outcome);
+	async_resend(worker, req->session, req->batch, req->targets + outcome, req->count - outcome, req->bulk);
+    } else {
+	target_done(worker, req->batch, 1);
+	for (i = 0, n = 0; i < req->count; i++) {
+	    if (i != outcome)
+		retry[n++] = req->targets[i];
+	}
+	COUNT(worker->counters->retries, 1);
+	async_resend(worker, req->session, req->batch, retry, n, req->bulk);
+    }
+    free(req);
+    return 1;
+}
+
+
+/* Async poll engine.  Each thread keeps up to set.window requests in
+   flight, multiplexed over one session per device; net-snmp matches
+   responses to requests by request-id and calls async_response().
+   Split retries may briefly push a thread past its window. */
+void *async_poller(void *thread_args)
+{
+    worker_t *worker = (worker_t *) thread_args;
+    crew_t *crew = worker->crew;
+    async_session_t *sessions = NULL;
+    async_session_t *as = NULL;
+    batch_t *batch = NULL;
+    batch_t *deferred[MAX_DEFERRED];
+    struct timeval timeout;
+    fd_set fdset;
+    double wake, nap, waited;
+    int fds, block, count, more, ndeferred, n;
+    int nsessions = 0;
+    int maxsessions = 0;
+
+    log_attach(worker->log);
+    if (set.verbose >= HIGH)
+	rtglog("Thread [%d] starting (async, window %d).\n", worker->index, set.window);
+    if (MYSQL_VERSION_ID > 40000)
+       mysql_thread_init();
+    else
+       my_thread_init();
+
+    worker->inflight = 0;
+
+    while (1) {
+	if (set.verbose >= DEVELOP)
+	    rtglog("Thread [%d] idle, waiting on round start\n", worker->index);
+	if (!round_wait(worker))
+	    break;
+
+	/* Each thread's share of the sessions that may be open, which for
+	   select() init_sessions() kept below FD_SETSIZE; a thread holding
+	   more would leave the others none */
+	maxsessions = sessions_max / crew->nthreads;
+	if (maxsessions < 1)
+	    maxsessions = 1;
+
+	more = TRUE;
+	ndeferred = 0;
+	while (more || ndeferred > 0 || worker->inflight > 0) {
+	    db_flush(worker, FALSE);
+	    /* Answers still owed from a round that was cut off need not
+	       keep us from the next one */
+	    if (!more && ndeferred == 0 && round_started(worker))
+		more = TRUE;
+	    /* Top up the window from the shared queue */
+	    if ((more || ndeferred > 0) && nsessions + set.window - worker->inflight > maxsessions)
+		nsessions = async_close_idle(&sessions);
+	    wake = time_now() + 1;
+	    while (worker->inflight < set.window && nsessions < maxsessions &&
+		   (batch = claim_batch(worker, deferred, &ndeferred, &more, &wake)) != NULL) {
+		if (set.verbose >= HIGH)
+		    rtglog("Thread [%d] processing %s (%d OIDs) (%d in flight)\n", worker->index, batch->device->host, batch->count, worker->inflight);
+		if (!device_up(batch->device, time_now())) {
+		    device_release(batch->device);
+		    for (n = 0; n < batch->count; n++)
+			process_result(worker, batch->targets[n], STAT_SKIPPED, NULL, NULL, 0);
+		    target_done(worker, batch, batch->count);
+		    continue;
+		}
+		if ((as = async_session(&sessions, &nsessions, batch->device)) == NULL) {
+		    device_release(batch->device);
+		    for (n = 0; n < batch->count; n++)
+			process_result(worker, batch->targets[n], STAT_DESCRIP_ERROR, NULL, NULL, 0);
+		    target_done(worker, batch, batch->count);
+		    continue;
+		}
+		if (!async_send(worker, as, batch, batch->targets, batch->count, batch->bulk))
+		    device_release(batch->device);
+	    }
+
+	    if (worker->inflight == 0) {
+		/* Every device we are holding work for is being paced */
+		if (ndeferred > 0 && (nap = wake - time_now()) > 0)
+		    usleep((unsigned int) (nap * 1000000));
+		continue;
+	    }
+
+	    /* Wait for responses, the next retransmit/timeout, or a paced
+	       device to come ready */
+	    fds = 0;
+	    block = 0;
+	    FD_ZERO(&fdset);
+	    timeout.tv_sec = 1;
+	    timeout.tv_usec = 0;
+	    if (ndeferred > 0) {
+		nap = wake - time_now();
+		if (nap < 0)
+		    nap = 0;
+		if (nap < 1) {
+		    timeout.tv_sec = 0;
+		    timeout.tv_usec = (long) (nap * 1000000);
+		}
+	    }
+	    for (as = sessions; as; as = as->next) {
+		if (as->inflight)
+		    snmp_sess_select_info(as->sessp, &fds, &fdset, &timeout, &block);
+	    }
+	    waited = time_now();
+	    count = select(fds, &fdset, NULL, NULL, &timeout);
+	    count_time(worker, PHASE_SNMP, waited);
+	    if (count < 0 && errno != EINTR)
+		rtglog("*** Async select error: %s\n", strerror(errno));
+	    for (as = sessions; as; as = as->next) {
+		if (as->inflight && count > 0)
+		    snmp_sess_read(as->sessp, &fdset);
+		if (as->inflight)
+		    snmp_sess_timeout(as->sessp);
+	    }
+	}
+
+	/* Hand the sessions back before a target file reload can free
+	   their devices */
+	nsessions = async_close_idle(&sessions);
+	/* Nothing is left waiting to be inserted while we are idle */
+	db_flush(worker, TRUE);
+    }				/* while(1) */
+
+    if (set.verbose >= HIGH)
+	rtglog("Thread [%d] retiring.\n", worker->index);
+    if (MYSQL_VERSION_ID > 40000)
+       mysql_thread_end();
+    else
+       my_thread_end();
+    return NULL;
+}
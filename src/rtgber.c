@@ -0,0 +1,265 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG BER encoding and decoding of SNMP GETs
+****************************************************************************/
+
+#include "common.h"
+#include "rtg.h"
+
+/* Just enough BER (X.690) to build SNMP v1/v2c GET requests and to read
+   the integer-valued answers to them, for the native engine.  Requests
+   are written back to front, so no length has to be known before its
+   contents are; responses are read front to back with every length
+   checked against the end of the datagram. */
+
+
+/* Write a tag and definite length in front of p.  Returns the new
+   start. */
+u_char *ber_put_header(u_char *p, u_char tag, size_t len) {
+	int n = 0;
+
+	if (len < 0x80) {
+		*--p = (u_char) len;
+	} else {
+		for (; len; len >>= 8, n++)
+			*--p = (u_char) (len & 0xff);
+		*--p = (u_char) (0x80 | n);
+	}
+	*--p = tag;
+	return p;
+}
+
+
+/* Write a non-negative INTEGER in front of p */
+u_char *ber_put_int(u_char *p, unsigned long val) {
+	u_char *end = p;
+
+	do {
+		*--p = (u_char) (val & 0xff);
+		val >>= 8;
+	} while (val);
+	if (*p & 0x80)
+		*--p = 0;
+	return ber_put_header(p, ASN_INTEGER, end - p);
+}
+
+
+/* Encode name as an OBJECT IDENTIFIER at the end of buf, which holds
+   size bytes.  Returns the encoded length, or 0 if name cannot be
+   encoded or does not fit. */
+int ber_oid(u_char *buf, size_t size, oid *name, size_t len) {
+	u_char *end = buf + size;
+	u_char *p = end;
+	unsigned long sub;
+	size_t i;
+
+	if (len < 2 || name[0] > 2 || (name[0] < 2 && name[1] >= 40))
+		return 0;
+	for (i = len; i-- > 1;) {
+		/* The first two subidentifiers share one */
+		sub = i > 1 ? name[i] : name[0] * 40 + name[1];
+		if (sub > 0xffffffffUL || p - buf < 5 + 6)
+			return 0;
+		*--p = (u_char) (sub & 0x7f);
+		while (sub >>= 7)
+			*--p = (u_char) (0x80 | (sub & 0x7f));
+	}
+	p = ber_put_header(p, ASN_OBJECT_ID, end - p);
+	return (end - p);
+}
+
+
+/* Encode a GET of count targets to d with request-id reqid, ending at
+   the end of buf, which holds size bytes.  Returns the start of the
+   message and sets *len, or NULL if a target has no encoded OID or the
+   message does not fit. */
+u_char *ber_get(u_char *buf, size_t size, device_t *d, long reqid, target_t **targets, int count, size_t *len) {
+	u_char *end = buf + size;
+	u_char *p = end;
+	size_t need = strlen(d->community) + PDU_OVERHEAD;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!targets[i]->ber)
+			return NULL;
+		need += targets[i]->ber_len + 8;
+	}
+	if (need > size)
+		return NULL;
+
+	for (i = count - 1; i >= 0; i--) {
+		*--p = 0;
+		*--p = ASN_NULL;
+		p -= targets[i]->ber_len;
+		memcpy(p, targets[i]->ber, targets[i]->ber_len);
+		p = ber_put_header(p, ASN_SEQUENCE | ASN_CONSTRUCTOR, targets[i]->ber_len + 2);
+	}
+	p = ber_put_header(p, ASN_SEQUENCE | ASN_CONSTRUCTOR, end - p);
+	p = ber_put_int(p, 0);		/* error-index */
+	p = ber_put_int(p, 0);		/* error-status */
+	p = ber_put_int(p, reqid);
+	p = ber_put_header(p, SNMP_MSG_GET, end - p);
+	i = strlen(d->community);
+	p -= i;
+	memcpy(p, d->community, i);
+	p = ber_put_header(p, ASN_OCTET_STR, i);
+	p = ber_put_int(p, d->version == 2 ? SNMP_VERSION_2c : SNMP_VERSION_1);
+	p = ber_put_header(p, ASN_SEQUENCE | ASN_CONSTRUCTOR, end - p);
+	*len = end - p;
+	return p;
+}
+
+
+/* Read the tag and length at *p and move *p to the contents.  Returns
+   FALSE if they are malformed or the contents run past end. */
+int ber_header(const u_char **p, const u_char *end, u_char *tag, size_t *len) {
+	const u_char *q = *p;
+	size_t l;
+	int n;
+
+	if (end - q < 2)
+		return FALSE;
+	*tag = *q++;
+	/* Multi-byte tags never occur in SNMP */
+	if ((*tag & 0x1f) == 0x1f)
+		return FALSE;
+	l = *q++;
+	if (l & 0x80) {
+		n = l & 0x7f;
+		if (n == 0 || n > (int) sizeof(size_t) || end - q < n)
+			return FALSE;
+		for (l = 0; n > 0; n--)
+			l = (l << 8) | *q++;
+	}
+	if (l > (size_t) (end - q))
+		return FALSE;
+	*p = q;
+	*len = l;
+	return TRUE;
+}
+
+
+/* Read the contents of a signed INTEGER */
+int ber_get_int(const u_char *p, size_t len, long *val) {
+	unsigned long v;
+
+	if (len < 1 || len > sizeof(long))
+		return FALSE;
+	v = (*p & 0x80) ? ~0UL : 0;
+	while (len-- > 0)
+		v = (v << 8) | *p++;
+	*val = (long) v;
+	return TRUE;
+}
+
+
+/* Read the contents of an unsigned type (Counter32, Gauge32, TimeTicks,
+   Counter64), which may have a leading zero octet */
+int ber_get_uint(const u_char *p, size_t len, unsigned long long *val) {
+	unsigned long long v = 0;
+
+	if (len < 1 || len > 9 || (len == 9 && *p != 0))
+		return FALSE;
+	while (len-- > 0)
+		v = (v << 8) | *p++;
+	*val = v;
+	return TRUE;
+}
+
+
+/* Read an INTEGER field at *p and step past it */
+int ber_field(const u_char **p, const u_char *end, long *val) {
+	u_char tag;
+	size_t len;
+
+	if (!ber_header(p, end, &tag, &len) || tag != ASN_INTEGER ||
+	    !ber_get_int(*p, len, val))
+		return FALSE;
+	*p += len;
+	return TRUE;
+}
+
+
+/* Parse an SNMP v1/v2c GetResponse in msg up to its varbind list.
+   Returns FALSE if it is not one; otherwise sets *reqid, *errstat and
+   *vbl and *vblen to the contents of the varbind list. */
+int ber_response(const u_char *msg, size_t len, long *reqid, long *errstat, const u_char **vbl, size_t *vblen) {
+	const u_char *p = msg;
+	const u_char *end = msg + len;
+	long version, errindex;
+	u_char tag;
+	size_t l;
+
+	if (!ber_header(&p, end, &tag, &l) || tag != (ASN_SEQUENCE | ASN_CONSTRUCTOR))
+		return FALSE;
+	end = p + l;
+	if (!ber_field(&p, end, &version) ||
+	    (version != SNMP_VERSION_1 && version != SNMP_VERSION_2c))
+		return FALSE;
+	if (!ber_header(&p, end, &tag, &l) || tag != ASN_OCTET_STR)
+		return FALSE;
+	p += l;
+	if (!ber_header(&p, end, &tag, &l) || tag != SNMP_MSG_RESPONSE)
+		return FALSE;
+	end = p + l;
+	if (!ber_field(&p, end, reqid) || !ber_field(&p, end, errstat) ||
+	    !ber_field(&p, end, &errindex))
+		return FALSE;
+	if (!ber_header(&p, end, &tag, &l) || tag != (ASN_SEQUENCE | ASN_CONSTRUCTOR))
+		return FALSE;
+	*vbl = p;
+	*vblen = l;
+	return TRUE;
+}
+
+
+/* Decode the varbind list of a response to a GET of count targets into
+   values, converting each as snmp_value() does.  Returns FALSE unless
+   every varbind names its target's OID, in order, and holds a number;
+   exceptions (noSuchObject and so on) and other types are left to
+   net-snmp. */
+int ber_values(const u_char *vbl, size_t vblen, target_t **targets, int count, unsigned long long *values) {
+	const u_char *p = vbl;
+	const u_char *end = vbl + vblen;
+	const u_char *next = NULL;
+	long val;
+	u_char tag;
+	size_t len;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!ber_header(&p, end, &tag, &len) || tag != (ASN_SEQUENCE | ASN_CONSTRUCTOR))
+			return FALSE;
+		next = p + len;
+		if (len < targets[i]->ber_len ||
+		    memcmp(p, targets[i]->ber, targets[i]->ber_len) != 0)
+			return FALSE;
+		p += targets[i]->ber_len;
+		if (!ber_header(&p, next, &tag, &len) || p + len != next)
+			return FALSE;
+		switch (tag) {
+			case ASN_INTEGER:
+				if (!ber_get_int(p, len, &val))
+					return FALSE;
+				values[i] = (unsigned long) val;
+				break;
+			case ASN_COUNTER:
+			case ASN_GAUGE:
+			case ASN_TIMETICKS:
+				if (len > 5 || !ber_get_uint(p, len, &values[i]) ||
+				    values[i] > THIRTYTWO)
+					return FALSE;
+				break;
+			case ASN_COUNTER64:
+				if (!ber_get_uint(p, len, &values[i]))
+					return FALSE;
+				break;
+			default:
+				return FALSE;
+		}
+		p = next;
+	}
+	return (p == end);
+}
@@ -0,0 +1,572 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG poller database inserts
+****************************************************************************/
+
+#include "common.h"
+#include "rtg.h"
+#include <errno.h>
+
+extern stats_t stats;
+
+/* Each worker gathers the rows it has to insert into each table, and
+   hands them to the database queue as one INSERT of many rows once
+   there are set.db_batch_rows of them or set.db_batch_bytes of SQL,
+   once the first has waited set.db_batch_age seconds, or when the
+   worker goes idle.  set.db_writers threads, each with a connection of
+   its own, take them from the queue and insert them, so a slow
+   database never holds up polling.  A batch the server rejects is
+   tried again a row at a time, so only the rows at fault are lost.
+   In DB_PREPARED mode no SQL is written: the rows go in through
+   prepared statements, cached on each connection, of
+   set.db_batch_rows rows or, for what is left over, a power of two.
+   In DB_LOAD mode each batch is one LOAD DATA LOCAL INFILE, read
+   straight from the buffer.
+
+   A writer pings its connection when it has been idle DB_PING seconds.
+   Reads and writes give up after DB_IO_TIMEOUT seconds, so a hung
+   server looks like a lost one.  A writer that loses its connection
+   puts the batch in hand back at the front of the queue for the others
+   and reconnects, waiting twice as long after every failure up to
+   DB_BACKOFF_MAX seconds; until then the connected writers take all
+   the work. */
+
+dbqueue_t dbq = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+dbwriter_t *writers = NULL;
+
+
+/* Return worker's buffer for table, making one if there is none.  The
+   buffer found is moved to the front, as a device's targets tend to
+   go to the same few tables. */
+dbbuf_t *db_buffer(worker_t *worker, char *table)
+{
+    dbbuf_t *buf = NULL;
+    dbbuf_t *prev = NULL;
+
+    for (buf = worker->dbbufs; buf; prev = buf, buf = buf->next) {
+	if (!strcmp(buf->table, table)) {
+	    if (prev) {
+		prev->next = buf->next;
+		buf->next = worker->dbbufs;
+		worker->dbbufs = buf;
+	    }
+	    return buf;
+	}
+    }
+
+    buf = (dbbuf_t *) calloc(1, sizeof(dbbuf_t));
+    if (buf && set.db_mode == DB_INSERT)
+	buf->sql = (char *) malloc(buf->size = 1024);
+    if (!buf || (set.db_mode == DB_INSERT && !buf->sql)) {
+	printf("Fatal insert buffer malloc error!\n");
+	exit(-1);
+    }
+    strncpy(buf->table, table, sizeof(buf->table) - 1);
+    if (set.db_mode == DB_INSERT)
+	buf->len = buf->head = snprintf(buf->sql, buf->size, "INSERT INTO %s VALUES ", table);
+    buf->next = worker->dbbufs;
+    worker->dbbufs = buf;
+    return buf;
+}
+
+
+/* Queue a row inserting value, received at time received, for entry */
+void db_queue(worker_t *worker, target_t *entry, unsigned long long value, double received)
+{
+    dbbuf_t *buf = db_buffer(worker, entry->table);
+    dbrow_t *r = NULL;
+    char row[DB_ROW_MAX];
+    size_t len;
+
+    if (buf->rows == buf->maxrows) {
+	buf->maxrows = buf->maxrows ? buf->maxrows * 2 : 64;
+	if ((buf->row = (dbrow_t *) realloc(buf->row, buf->maxrows * sizeof(dbrow_t))) == NULL) {
+	    printf("Fatal insert buffer malloc error!\n");
+	    exit(-1);
+	}
+    }
+    r = &(buf->row[buf->rows]);
+    r->value = value;
+    r->received = received;
+    r->iid = entry->iid;
+    r->iclass = entry->iclass - hash.classes;
+
+    if (set.db_mode == DB_INSERT) {
+	if (set.dbsubsecond)
+	    len = snprintf(row, sizeof(row), "%s(%d, FROM_UNIXTIME(%.6f), %llu)",
+		buf->rows ? "," : "", entry->iid, received, value);
+	else
+	    len = snprintf(row, sizeof(row), "%s(%d, FROM_UNIXTIME(%ld), %llu)",
+		buf->rows ? "," : "", entry->iid, (long) received, value);
+	if (buf->len + len + 1 > buf->size) {
+	    buf->size *= 2;
+	    if ((buf->sql = (char *) realloc(buf->sql, buf->size)) == NULL) {
+		printf("Fatal insert buffer malloc error!\n");
+		exit(-1);
+	    }
+	}
+	r->at = buf->len + (buf->rows ? 1 : 0);
+	memcpy(buf->sql + buf->len, row, len + 1);
+	buf->len += len;
+    }
+    if (buf->rows++ == 0) {
+	buf->since = time_now();
+	if (!worker->db_since)
+	    worker->db_since = buf->since;
+    }
+
+    /* db_buffer() left buf at the front */
+    if (buf->rows >= set.db_batch_rows || buf->len >= set.db_batch_bytes) {
+	worker->dbbufs = buf->next;
+	db_post(worker, buf);
+    }
+}
+
+
+/* Hand buf, no longer on worker's list, to the writers; if the queue
+   is full its rows are dropped instead */
+void db_post(worker_t *worker, dbbuf_t *buf)
+{
+    buf->next = NULL;
+    PT_MUTEX_LOCK(&dbq.mutex);
+    if (dbq.depth >= set.db_queue) {
+	PT_MUTEX_UNLOCK(&dbq.mutex);
+	COUNT(worker->counters->db_dropped, buf->rows);
+	if (set.verbose >= LOW)
+	    rtglog("*** Database queue full, dropped %d rows for %s.\n", buf->rows, buf->table);
+	db_free(buf);
+	return;
+    }
+    buf->generation = dbq.generation;
+    if (dbq.tail)
+	dbq.tail->next = buf;
+    else
+	dbq.head = buf;
+    dbq.tail = buf;
+    if (++(dbq.depth) > dbq.peak)
+	dbq.peak = dbq.depth;
+    pthread_cond_signal(&dbq.ready);
+    PT_MUTEX_UNLOCK(&dbq.mutex);
+}
+
+
+/* Hand worker's rows that have waited set.db_batch_age seconds, or all
+   of them (and free its buffers) if all, to the writers */
+void db_flush(worker_t *worker, int all)
+{
+    dbbuf_t *buf = NULL;
+    dbbuf_t *next = NULL;
+    dbbuf_t **keep = &(worker->dbbufs);
+    double now, since = 0;
+
+    if (!worker->dbbufs)
+	return;
+    now = time_now();
+    if (!all && (!worker->db_since || now - worker->db_since < set.db_batch_age))
+	return;
+
+    for (buf = worker->dbbufs; buf; buf = next) {
+	next = buf->next;
+	if (buf->rows > 0 && (all || now - buf->since >= set.db_batch_age)) {
+	    db_post(worker, buf);
+	} else if (all) {
+	    db_free(buf);
+	} else {
+	    if (buf->rows > 0 && (!since || buf->since < since))
+		since = buf->since;
+	    *keep = buf;
+	    keep = &(buf->next);
+	}
+    }
+    *keep = NULL;
+    worker->db_since = since;
+}
+
+
+void db_free(dbbuf_t *buf)
+{
+    free(buf->sql);
+    free(buf->row);
+    free(buf);
+}
+
+
+/* Start set.db_writers writers, each with a connection of its own.
+   Returns FALSE if the first cannot connect; any other that cannot
+   keeps trying. */
+int db_start()
+{
+    dbwriter_t *writer = NULL;
+    int i;
+
+    writers = (dbwriter_t *) calloc(set.db_writers, sizeof(dbwriter_t));
+    if (!writers) {
+	printf("Fatal writer malloc error!\n");
+	exit(-1);
+    }
+    for (i = 0; i < set.db_writers; i++) {
+	writer = &(writers[i]);
+	writer->worker.index = i;
+	writer->worker.counters = counters_new();
+	writer->backoff = 1;
+	if (db_connect(writer)) {
+	    writer->up = TRUE;
+	} else if (i == 0) {
+	    return FALSE;
+	} else {
+	    writer->retry_at = time_now() + writer->backoff;
+	}
+    }
+    for (i = 0; i < set.db_writers; i++) {
+	if (pthread_create(&(writers[i].worker.thread), NULL, db_writer, (void *) &(writers[i])) != 0) {
+	    printf("pthread_create error\n");
+	    exit(-1);
+	}
+    }
+    return TRUE;
+}
+
+
+/* Open writer's connection.  Returns TRUE if it is up. */
+int db_connect(dbwriter_t *writer)
+{
+    MYSQL *mysql = &(writer->mysql);
+    unsigned int timeout = DB_CONNECT_TIMEOUT;
+    unsigned int io_timeout = DB_IO_TIMEOUT;
+    unsigned int local = TRUE;
+
+    mysql_init(mysql);
+    mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, (char *) &timeout);
+    mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, (char *) &io_timeout);
+    mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, (char *) &io_timeout);
+    if (set.db_mode == DB_LOAD)
+	mysql_options(mysql, MYSQL_OPT_LOCAL_INFILE, (char *) &local);
+    if (!mysql_real_connect(mysql, set.dbhost, set.dbuser, set.dbpass, set.dbdb, 0, NULL, 0)) {
+	rtglog("*** Writer [%d] could not connect to the database: %s\n",
+	    writer->worker.index, mysql_error(mysql));
+	mysql_close(mysql);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* Close writer's connection, which has gone, and try again in a while */
+void db_lost(dbwriter_t *writer)
+{
+    rtglog("*** Writer [%d] lost its database connection: %s\n",
+	writer->worker.index, mysql_error(&(writer->mysql)));
+    db_unprepare(&(writer->stmts), &(writer->nstmts));
+    mysql_close(&(writer->mysql));
+    writer->up = FALSE;
+    writer->backoff = 1;
+    writer->retry_at = time_now() + writer->backoff;
+}
+
+
+/* A database writer */
+void *db_writer(void *arg)
+{
+    dbwriter_t *writer = (dbwriter_t *) arg;
+    dbbuf_t *buf = NULL;
+    struct timespec ts;
+    double wake, nap;
+
+    if (set.verbose >= HIGH)
+	rtglog("Writer [%d] starting.\n", writer->worker.index);
+    if (MYSQL_VERSION_ID > 40000)
+       mysql_thread_init();
+    else
+       my_thread_init();
+
+    PT_MUTEX_LOCK(&dbq.mutex);
+    while (1) {
+	if (!writer->up) {
+	    PT_MUTEX_UNLOCK(&dbq.mutex);
+	    if ((nap = writer->retry_at - time_now()) > 0)
+		usleep((unsigned int) (nap * 1000000));
+	    if (db_connect(writer)) {
+		if (set.verbose >= LOW)
+		    rtglog("Writer [%d] reconnected to the database.\n", writer->worker.index);
+		writer->up = TRUE;
+		writer->backoff = 1;
+		PT_MUTEX_LOCK(&dbq.mutex);
+		continue;
+	    }
+	    if ((writer->backoff *= 2) > DB_BACKOFF_MAX)
+		writer->backoff = DB_BACKOFF_MAX;
+	    writer->retry_at = time_now() + writer->backoff;
+	    PT_MUTEX_LOCK(&dbq.mutex);
+	    continue;
+	}
+
+	if (!dbq.head) {
+	    wake = time_now() + DB_PING;
+	    ts.tv_sec = (time_t) wake;
+	    ts.tv_nsec = (long) ((wake - ts.tv_sec) * 1000000000);
+	    while (!dbq.head && pthread_cond_timedwait(&dbq.ready, &dbq.mutex, &ts) != ETIMEDOUT)
+		;
+	    if (!dbq.head) {
+		PT_MUTEX_UNLOCK(&dbq.mutex);
+		if (mysql_ping(&(writer->mysql)))
+		    db_lost(writer);
+		PT_MUTEX_LOCK(&dbq.mutex);
+	    }
+	    continue;
+	}
+
+	buf = dbq.head;
+	if ((dbq.head = buf->next) == NULL)
+	    dbq.tail = NULL;
+	dbq.depth--;
+	PT_MUTEX_UNLOCK(&dbq.mutex);
+
+	if (db_write(writer, buf) < 0) {
+	    /* Back to the front of the queue, for a writer still up */
+	    PT_MUTEX_LOCK(&dbq.mutex);
+	    if ((buf->next = dbq.head) == NULL)
+		dbq.tail = buf;
+	    dbq.head = buf;
+	    dbq.depth++;
+	    pthread_cond_signal(&dbq.ready);
+	    PT_MUTEX_UNLOCK(&dbq.mutex);
+	    db_lost(writer);
+	    PT_MUTEX_LOCK(&dbq.mutex);
+	    continue;
+	}
+	db_free(buf);
+	PT_MUTEX_LOCK(&dbq.mutex);
+    }
+    return NULL;
+}
+
+
+/* Insert the rows in buf through writer's connection.  Returns how
+   many were written, or -1 if the connection was lost, leaving in buf
+   the rows not yet tried. */
+int db_write(dbwriter_t *writer, dbbuf_t *buf)
+{
+    double start = time_now();
+    int written;
+
+    if (set.db_mode == DB_PREPARED) {
+	if (set.verbose >= DEBUG)
+	    rtglog("SQL: %d rows into %s, prepared.\n", buf->rows, buf->table);
+	written = db_write_prepared(writer, buf);
+    } else if (set.db_mode == DB_LOAD) {
+	if (set.verbose >= DEBUG)
+	    rtglog("SQL: %d rows into %s, loaded.\n", buf->rows, buf->table);
+	written = db_write_load(writer, buf);
+    } else {
+	if (set.verbose >= DEBUG)
+	    rtglog("SQL: %s\n", buf->sql);
+	written = db_write_sql(writer, buf);
+    }
+    count_time(&(writer->worker), PHASE_DB, start);
+    return written;
+}
+
+
+/* db_write() as one multi-row INSERT; if the server rejects it, a row
+   at a time */
+int db_write_sql(dbwriter_t *writer, dbbuf_t *buf)
+{
+    MYSQL *mysql = &(writer->mysql);
+    char query[BUFSIZE];
+    size_t end;
+    int written = 0;
+    int i;
+
+    if (!mysql_query(mysql, buf->sql)) {
+	db_written(writer, buf, 0, buf->rows);
+	return buf->rows;
+    }
+    if (mysql_ping(mysql))
+	return -1;
+    if (buf->rows == 1) {
+	rtglog("*** MySQL Error: %s\n", mysql_error(mysql));
+	return 0;
+    }
+    rtglog("*** MySQL Error: %s, inserting %d rows into %s one at a time.\n",
+	mysql_error(mysql), buf->rows, buf->table);
+    for (i = 0; i < buf->rows; i++) {
+	end = (i + 1 < buf->rows) ? buf->row[i + 1].at - 1 : buf->len;
+	snprintf(query, sizeof(query), "%.*s%.*s", (int) buf->head, buf->sql,
+	    (int) (end - buf->row[i].at), buf->sql + buf->row[i].at);
+	if (mysql_query(mysql, query)) {
+	    if (mysql_ping(mysql)) {
+		db_trim(buf, i);
+		return -1;
+	    }
+	    rtglog("*** MySQL Error: %s [%s]\n", mysql_error(mysql), query);
+	    continue;
+	}
+	db_written(writer, buf, i, 1);
+	written++;
+    }
+    return written;
+}
+
+
+/* db_write() through writer's prepared statements: set.db_batch_rows
+   rows to a statement, and what is left over in powers of two, so each
+   table needs only a few.  Rows in a statement the server rejects are
+   tried again one at a time. */
+int db_write_prepared(dbwriter_t *writer, dbbuf_t *buf)
+{
+    MYSQL *mysql = &(writer->mysql);
+    dbstmt_t *st = NULL;
+    dbrow_t *r = NULL;
+    int written = 0;
+    int i, j, n;
+
+    for (i = 0; i < buf->rows; i += n) {
+	if ((n = buf->rows - i) < set.db_batch_rows) {
+	    for (j = 1; j * 2 <= n; j *= 2)
+		;
+	    n = j;
+	} else {
+	    n = set.db_batch_rows;
+	}
+	st = db_prepare(mysql, &(writer->stmts), &(writer->nstmts), buf->table, n);
+	if (st && !db_execute(st, buf->row + i)) {
+	    db_written(writer, buf, i, n);
+	    written += n;
+	    continue;
+	}
+	if (mysql_ping(mysql)) {
+	    db_trim(buf, i);
+	    return -1;
+	}
+	if (n > 1)
+	    rtglog("*** MySQL Error: %s, inserting %d rows into %s one at a time.\n",
+		st ? mysql_stmt_error(st->stmt) : mysql_error(mysql), n, buf->table);
+	for (j = i; j < i + n; j++) {
+	    if (n > 1) {
+		st = db_prepare(mysql, &(writer->stmts), &(writer->nstmts), buf->table, 1);
+		if (st && !db_execute(st, buf->row + j)) {
+		    db_written(writer, buf, j, 1);
+		    written++;
+		    continue;
+		}
+		if (mysql_ping(mysql)) {
+		    db_trim(buf, j);
+		    return -1;
+		}
+	    }
+	    r = &(buf->row[j]);
+	    rtglog("*** MySQL Error: %s [%s (%d, %.6f, %llu)]\n",
+		st ? mysql_stmt_error(st->stmt) : mysql_error(mysql),
+		buf->table, r->iid, r->received, r->value);
+	}
+    }
+    return written;
+}
+
+
+/* db_write() as one LOAD DATA LOCAL INFILE.  The server skips the rows
+   it cannot take rather than failing the load; as it does not say
+   which they were, the rest are then only counted in the total. */
+int db_write_load(dbwriter_t *writer, dbbuf_t *buf)
+{
+    MYSQL *mysql = &(writer->mysql);
+    int loaded;
+
+    if (db_load(mysql, buf->table, buf->row, buf->rows)) {
+	if (mysql_ping(mysql))
+	    return -1;
+	rtglog("*** MySQL Error: %s, %d rows for %s lost.\n",
+	    mysql_error(mysql), buf->rows, buf->table);
+	return 0;
+    }
+    if ((loaded = (int) mysql_affected_rows(mysql)) == buf->rows) {
+	db_written(writer, buf, 0, loaded);
+    } else {
+	rtglog("*** MySQL skipped %d of %d rows loading %s.\n",
+	    buf->rows - loaded, buf->rows, buf->table);
+	COUNT(writer->worker.counters->db_inserts, loaded);
+    }
+    return loaded;
+}
+
+
+/* Count n of buf's rows from the first'th as written.  Rows queued
+   before a reload are not counted by class, as their classes have gone;
+   dbq.mutex keeps the tallies from being replaced under us. */
+void db_written(dbwriter_t *writer, dbbuf_t *buf, int first, int n)
+{
+    counters_t *counters = writer->worker.counters;
+    int i;
+
+    PT_MUTEX_LOCK(&dbq.mutex);
+    if (buf->generation == dbq.generation) {
+	for (i = first; i < first + n; i++)
+	    COUNT(counters->tally[buf->row[i].iclass].db_inserts, 1);
+    }
+    PT_MUTEX_UNLOCK(&dbq.mutex);
+    COUNT(counters->db_inserts, n);
+}
+
+
+/* Drop the first n of buf's rows */
+void db_trim(dbbuf_t *buf, int n)
+{
+    size_t gone;
+    int i;
+
+    if (n <= 0)
+	return;
+    if (set.db_mode == DB_INSERT) {
+	gone = buf->row[n].at - buf->head;
+	memmove(buf->sql + buf->head, buf->sql + buf->row[n].at, buf->len - buf->row[n].at + 1);
+	buf->len -= gone;
+	for (i = n; i < buf->rows; i++)
+	    buf->row[i].at -= gone;
+    }
+    memmove(buf->row, buf->row + n, (buf->rows - n) * sizeof(dbrow_t));
+    buf->rows -= n;
+}
+
+
+/* Keep the writers from counting rows by class until db_release().
+   Called on a reload, while every worker is idle, before the interval
+   classes the rows are counted in go away.  It never waits on the
+   database: whatever is still queued or being written is written, but
+   not counted by class. */
+void db_hold()
+{
+    PT_MUTEX_LOCK(&dbq.mutex);
+    dbq.generation++;
+}
+
+
+void db_release()
+{
+    PT_MUTEX_UNLOCK(&dbq.mutex);
+}
+
+
+/* Copy the queue's depth and peak into stats, with the rows written
+   since the last call and the time the writers took, and start again */
+void db_stats()
+{
+    unsigned long long rows = 0;
+    unsigned long long usecs = 0;
+    int i;
+
+    for (i = 0; writers && i < set.db_writers; i++) {
+	rows += COUNTED(writers[i].worker.counters->db_inserts);
+	usecs += COUNTED(writers[i].worker.counters->usecs[PHASE_DB]);
+    }
+    PT_MUTEX_LOCK(&dbq.mutex);
+    stats.db_depth = dbq.depth;
+    stats.db_peak = dbq.peak;
+    stats.db_rows = rows - dbq.rows;
+    stats.db_time = (usecs - dbq.usecs) / 1000000.0;
+    dbq.peak = dbq.depth;
+    dbq.rows = rows;
+    dbq.usecs = usecs;
+    PT_MUTEX_UNLOCK(&dbq.mutex);
+}
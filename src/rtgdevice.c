@@ -0,0 +1,816 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG device table and request batching
+****************************************************************************/
+
+#include "common.h"
+#include "rtg.h"
+
+extern stats_t stats;
+
+/* Hash a host/community pair */
+unsigned long device_key(const char *h, const char *c) {
+	unsigned long hashval;
+
+	for (hashval = 0; *c != '\0'; c++)
+		hashval = (((unsigned int) *c) | 0x20) + 31 * hashval;
+	for (;*h != '\0'; h++)
+		hashval = (((unsigned int) *h) | 0x20) + 31 * hashval;
+
+	return (hashval % HASHSIZE);
+}
+
+
+/* return ptr to the device for host/community, NULL if none */
+device_t *find_device(const char *host, const char *community) {
+	device_t *d = NULL;
+
+	for (d = hash.devices[device_key(host, community)]; d; d = d->next) {
+		if (!strcmp(d->host, host) && !strcmp(d->community, community))
+			return d;
+	}
+	return NULL;
+}
+
+
+/* Parse "key=value" device options into device.  Returns -1 if any
+   option was not understood, which is reported unless quiet. */
+int device_options(device_t *device, char *opts, int quiet) {
+	char buffer[BUFSIZE];
+	char key[32];
+	char val[32];
+	char *tok = NULL;
+	char *last = NULL;
+	int status = 0;
+
+	strncpy(buffer, opts, sizeof(buffer));
+	buffer[sizeof(buffer) - 1] = '\0';
+	for (tok = strtok_r(buffer, " \t\r\n", &last); tok;
+	     tok = strtok_r(NULL, " \t\r\n", &last)) {
+		if (*tok == '#')
+			break;
+		if (sscanf(tok, "%31[^=]=%31s", key, val) != 2) {
+			if (!quiet)
+				printf("*** Bad device option for %s: %s\n", device->host, tok);
+			status = -1;
+		} else if (!strcasecmp(key, "maxoids")) {
+			device->maxoids = atoi(val);
+			if (device->maxoids < 1 || device->maxoids > MAX_OIDS) {
+				if (!quiet)
+					printf("*** Invalid maxoids for %s: %s (max=%d).\n",
+						device->host, val, MAX_OIDS);
+				device->maxoids = set.max_oids;
+				status = -1;
+			}
+		} else if (!strcasecmp(key, "maxreps")) {
+			device->maxreps = atoi(val);
+			if (device->maxreps > MAX_REPS) {
+				if (!quiet)
+					printf("*** Invalid maxreps for %s: %s (max=%d).\n",
+						device->host, val, MAX_REPS);
+				device->maxreps = set.max_reps;
+				status = -1;
+			}
+		} else if (!strcasecmp(key, "inflight")) {
+			device->maxinflight = atoi(val);
+		} else if (!strcasecmp(key, "gap")) {
+			device->mingap = atoi(val);
+		} else if (!strcasecmp(key, "port")) {
+			device->port = atoi(val);
+		} else if (!strcasecmp(key, "version")) {
+			device->version = atoi(val);
+			if (device->version != 1 && device->version != 2) {
+				if (!quiet)
+					printf("*** Unsupported SNMP version for %s: %s.\n",
+						device->host, val);
+				device->version = set.snmp_ver;
+				status = -1;
+			}
+		} else {
+			if (!quiet)
+				printf("*** Unrecognized device option for %s: %s\n",
+					device->host, key);
+			status = -1;
+		}
+	}
+	return status;
+}
+
+
+/* return ptr to the options given for host, NULL if none */
+devopt_t *find_devopt(devopt_t *list, const char *host) {
+	while (list) {
+		if (!strcmp(list->host, host))
+			return list;
+		list = list->next;
+	}
+	return NULL;
+}
+
+
+void free_devopts(devopt_t *list) {
+	devopt_t *f = NULL;
+
+	while (list) {
+		f = list;
+		list = list->next;
+		free(f);
+	}
+}
+
+
+/* (Re)build the device table from the target hash.  Devices survive
+   target file reloads as long as some target still references them;
+   their options are reset to the defaults plus any "device" line. */
+void build_devices(devopt_t *devopts) {
+	device_t *d = NULL;
+	device_t *prev = NULL;
+	device_t *next = NULL;
+	devopt_t *opt = NULL;
+	target_t *p = NULL;
+	unsigned long key;
+	int i;
+
+	for (i=0;i<HASHSIZE;i++) {
+		for (d = hash.devices[i]; d; d = d->next) {
+			d->init = STALE;
+			d->targets = 0;
+			d->list = NULL;
+		}
+	}
+
+	for (i=0;i<HASHSIZE;i++) {
+		for (p = hash.table[i]; p; p = p->next) {
+			d = find_device(p->host, p->community);
+			if (!d) {
+				d = (device_t *) malloc(sizeof(device_t));
+				if (!d) {
+					printf("Fatal device malloc error!\n");
+					exit(-1);
+				}
+				memset(d, 0, sizeof(device_t));
+				pthread_mutex_init(&(d->pace), NULL);
+				strncpy(d->host, p->host, sizeof(d->host));
+				strncpy(d->community, p->community, sizeof(d->community));
+				d->init = NEW;
+				key = device_key(d->host, d->community);
+				d->next = hash.devices[key];
+				hash.devices[key] = d;
+			}
+			if (d->init != LIVE) {
+				d->init = LIVE;
+				d->port = set.snmp_port;
+				d->version = set.snmp_ver;
+				d->maxoids = set.max_oids;
+				d->maxreps = set.max_reps;
+				d->maxinflight = set.dev_inflight;
+				d->mingap = set.dev_gap;
+				d->inflight = 0;
+				d->next_send = 0;
+				if ((opt = find_devopt(devopts, d->host)))
+					device_options(d, opt->opts, TRUE);
+				if (set.engine == NATIVE)
+					d->native = native_addr(d);
+			}
+			p->device = d;
+			p->dnext = d->list;
+			d->list = p;
+			d->targets++;
+		}
+	}
+
+	/* Drop devices no target references any more */
+	for (i=0;i<HASHSIZE;i++) {
+		prev = NULL;
+		for (d = hash.devices[i]; d; d = next) {
+			next = d->next;
+			if (d->init == STALE) {
+				if (prev)
+					prev->next = next;
+				else
+					hash.devices[i] = next;
+				pthread_mutex_destroy(&(d->pace));
+				free(d);
+			} else {
+				prev = d;
+			}
+		}
+	}
+}
+
+
+/* Split a target's OID into column and instance.  Returns FALSE if it
+   has no column part. */
+int walk_column(target_t *p) {
+	p->collen = 0;
+	if (p->anOID_len < 2)
+		return FALSE;
+	p->collen = p->anOID_len - 1;
+	p->instance = p->anOID[p->collen];
+	return TRUE;
+}
+
+
+/* qsort() order for a device's targets: by interval, then walks by
+   column and instance ahead of targets to GET */
+int compare_walk(const void *a, const void *b) {
+	target_t *p = *(target_t **) a;
+	target_t *q = *(target_t **) b;
+	int cmp;
+
+	cmp = (p->interval > q->interval) - (p->interval < q->interval);
+	if (cmp == 0)
+		cmp = (q->collen != 0) - (p->collen != 0);
+	if (cmp == 0 && p->collen)
+		cmp = snmp_oid_compare(p->anOID, p->collen, q->anOID, q->collen);
+	if (cmp == 0)
+		cmp = (p->instance > q->instance) - (p->instance < q->instance);
+	return cmp;
+}
+
+
+/* Reorder a device's target list by interval class.  Within a class,
+   columns with more than one target come first, sorted by instance,
+   ready to be walked with GETBULK; targets not worth walking keep
+   collen 0 and follow. */
+void sort_walks(device_t *d) {
+	target_t **walks = NULL;
+	target_t *p = NULL;
+	target_t **tail = NULL;
+	int n = 0;
+	int i, j;
+
+	walks = (target_t **) malloc(d->targets * sizeof(target_t *));
+	if (!walks) {
+		printf("Fatal walk malloc error!\n");
+		exit(-1);
+	}
+	for (p = d->list; p; p = p->dnext) {
+		/* GETBULK is not in SNMPv1 */
+		if (d->maxreps == 0 || d->version != 2 || !walk_column(p)) {
+			p->collen = 0;
+			p->instance = 0;
+		}
+		walks[n++] = p;
+	}
+	qsort(walks, n, sizeof(target_t *), compare_walk);
+
+	/* A lone target in its column is cheaper to GET */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && walks[i]->collen && walks[j]->interval == walks[i]->interval &&
+		     !snmp_oid_compare(walks[j]->anOID, walks[j]->collen,
+		     walks[i]->anOID, walks[i]->collen); j++)
+			;
+		if (j - i == 1)
+			walks[i]->collen = 0;
+	}
+	qsort(walks, n, sizeof(target_t *), compare_walk);
+
+	tail = &(d->list);
+	for (i = 0; i < n; i++) {
+		*tail = walks[i];
+		tail = &(walks[i]->dnext);
+	}
+	*tail = NULL;
+	free(walks);
+}
+
+
+/* return ptr to the class of targets polled every interval seconds,
+   NULL if none */
+iclass_t *find_class(iclass_t *classes, int nclasses, unsigned int interval) {
+	int i;
+
+	for (i = 0; i < nclasses; i++) {
+		if (classes[i].interval == interval)
+			return &(classes[i]);
+	}
+	return NULL;
+}
+
+
+/* (Re)build the interval classes, in increasing order of interval, and
+   pick the round length hash.tick: the largest that divides every
+   class's interval.  A class's counters survive target file reloads
+   while any of its targets stay. */
+void build_classes() {
+	iclass_t *old = hash.classes;
+	iclass_t *c = NULL;
+	iclass_t *o = NULL;
+	device_t *d = NULL;
+	target_t *p = NULL;
+	unsigned int tick = 0;
+	unsigned int a, b;
+	int nold = hash.nclasses;
+	int i, j;
+
+	hash.classes = NULL;
+	hash.nclasses = 0;
+	for (i=0;i<HASHSIZE;i++) {
+		for (d = hash.devices[i]; d; d = d->next) {
+			for (p = d->list; p; p = p->dnext) {
+				if ((c = find_class(hash.classes, hash.nclasses, p->interval))) {
+					c->ntargets++;
+					continue;
+				}
+				c = (iclass_t *) realloc(hash.classes, (hash.nclasses + 1) * sizeof(iclass_t));
+				if (!c) {
+					printf("Fatal class malloc error!\n");
+					exit(-1);
+				}
+				hash.classes = c;
+				for (j = hash.nclasses; j > 0 && c[j - 1].interval > p->interval; j--)
+					c[j] = c[j - 1];
+				memset(&c[j], 0, sizeof(iclass_t));
+				c[j].interval = p->interval;
+				c[j].ntargets = 1;
+				hash.nclasses++;
+			}
+		}
+	}
+
+	/* Rows already written are counted in the old classes */
+	db_hold();
+	counters_fold(old, nold);
+	db_release();
+	for (i = 0; i < hash.nclasses; i++) {
+		c = &(hash.classes[i]);
+		if ((o = find_class(old, nold, c->interval))) {
+			c->polls = o->polls;
+			c->db_inserts = o->db_inserts;
+			c->no_resp = o->no_resp;
+			c->errors = o->errors;
+			c->rounds = o->rounds;
+		}
+		for (a = tick, b = c->interval; b; ) {
+			tick = b;
+			b = a % b;
+			a = tick;
+		}
+	}
+	for (i = 0; i < nold; i++)
+		free(old[i].first);
+	free(old);
+	if (tick == 0)
+		tick = set.interval;
+
+	/* Keep the wheels turning from where they were if we can */
+	if (tick != hash.tick) {
+		hash.tick = tick;
+		hash.rounds = 0;
+	}
+}
+
+
+/* Where in [0, 1) of the spread a target falls.  FNV-1a over host and
+   OID: unlike make_key(), similar host names land far apart. */
+double spread_phase(target_t *p) {
+	unsigned int h = 2166136261u;
+	const char *c;
+
+	for (c = p->host; *c != '\0'; c++)
+		h = (h ^ (unsigned char) *c) * 16777619u;
+	for (c = p->objoid; *c != '\0'; c++)
+		h = (h ^ (unsigned char) *c) * 16777619u;
+	return ((double) h / 4294967296.0);
+}
+
+
+/* qsort() order for a class's batches: by wheel slot, then offset */
+int compare_offset(const void *a, const void *b) {
+	const batch_t *p = (const batch_t *) a;
+	const batch_t *q = (const batch_t *) b;
+
+	if (p->slot != q->slot)
+		return (p->slot - q->slot);
+	return ((p->offset > q->offset) - (p->offset < q->offset));
+}
+
+
+/* Lay each class's batches out on its wheel.  Unless polls are spread,
+   every batch goes in slot 0 at offset 0, so a class is polled all at
+   once every interval.  Otherwise a hash of the batch's first target,
+   which does not change while the target stays in the file, picks both
+   its slot and its offset into the first set.spread of the round. */
+void build_wheels() {
+	iclass_t *c = NULL;
+	batch_t *b = NULL;
+	double phase;
+	int i, j;
+
+	for (i = 0; i < hash.nclasses; i++) {
+		c = &(hash.classes[i]);
+		c->slots = c->interval / hash.tick;
+		c->first = (int *) malloc((c->slots + 1) * sizeof(int));
+		if (!c->first) {
+			printf("Fatal class malloc error!\n");
+			exit(-1);
+		}
+		for (j = 0; j < c->nbatches; j++) {
+			b = &(c->batches[j]);
+			b->slot = 0;
+			b->offset = 0;
+			if (set.spread > 0) {
+				phase = spread_phase(b->targets[0]) * c->slots;
+				b->slot = (int) phase;
+				b->offset = (phase - b->slot) * set.spread * hash.tick;
+			}
+		}
+		if (set.spread > 0)
+			qsort(c->batches, c->nbatches, sizeof(batch_t), compare_offset);
+		for (j = 0, b = c->batches; j <= c->slots; j++) {
+			while (b < c->batches + c->nbatches && b->slot < j)
+				b++;
+			c->first[j] = b - c->batches;
+		}
+	}
+}
+
+
+/* Group each device's targets into batches of at most maxoids varbinds
+   whose request fits in set.max_pdu bytes, or into walks of at most
+   maxreps rows of one column.  A batch only holds targets of one
+   interval class, and a class's batches are laid out round robin
+   across devices so consecutive requests go to different hosts. */
+void build_batches() {
+	device_t **active = NULL;
+	device_t *d = NULL;
+	iclass_t *c = NULL;
+	target_t *p = NULL;
+	target_t *w = NULL;
+	batch_t *b = NULL;
+	int nactive = 0;
+	int members = 0;
+	int size = 0;
+	int vbsize = 0;
+	int i, j, k;
+
+	free(hash.batches);
+	free(hash.members);
+	free(hash.due);
+	hash.batches = NULL;
+	hash.members = NULL;
+	hash.due = NULL;
+	hash.nbatches = 0;
+	hash.ntargets = 0;
+
+	for (i=0;i<HASHSIZE;i++) {
+		for (d = hash.devices[i]; d; d = d->next) {
+			hash.ntargets += d->targets;
+			nactive++;
+		}
+	}
+	build_classes();
+	if (hash.ntargets == 0)
+		return;
+
+	active = (device_t **) malloc(nactive * sizeof(device_t *));
+	hash.members = (target_t **) malloc(hash.ntargets * sizeof(target_t *));
+	hash.batches = (batch_t *) malloc(hash.ntargets * sizeof(batch_t));
+	hash.due = (batch_t **) malloc(hash.ntargets * sizeof(batch_t *));
+	if (!active || !hash.members || !hash.batches || !hash.due) {
+		printf("Fatal batch malloc error!\n");
+		exit(-1);
+	}
+	for (i=0;i<HASHSIZE;i++) {
+		for (d = hash.devices[i]; d; d = d->next) {
+			sort_walks(d);
+			d->cursor = d->list;
+		}
+	}
+
+	/* Device target lists are in class order, so each device's cursor
+	   is at the start of the class being built or of a later one */
+	for (k = 0; k < hash.nclasses; k++) {
+		c = &(hash.classes[k]);
+		c->batches = &(hash.batches[hash.nbatches]);
+		nactive = 0;
+		for (i=0;i<HASHSIZE;i++) {
+			for (d = hash.devices[i]; d; d = d->next) {
+				if (d->cursor && d->cursor->interval == c->interval)
+					active[nactive++] = d;
+			}
+		}
+
+		/* Each pass takes one batch from every device with targets left */
+		while (nactive > 0) {
+			for (i = 0, j = 0; i < nactive; i++) {
+				d = active[i];
+				b = &(hash.batches[hash.nbatches++]);
+				b->device = d;
+				b->targets = &(hash.members[members]);
+				b->count = 0;
+				b->bulk = 0;
+				b->pending = 0;
+				b->round = 0;
+				if ((w = d->cursor)->collen) {
+					/* Rows of one column, walked with GETBULK */
+					b->bulk = d->maxreps;
+					while ((p = d->cursor) && b->count < d->maxreps &&
+					       p->interval == c->interval &&
+					       !snmp_oid_compare(p->anOID, p->collen, w->anOID, w->collen)) {
+						hash.members[members++] = p;
+						p->iclass = c;
+						b->count++;
+						d->cursor = p->dnext;
+					}
+				} else {
+					size = PDU_OVERHEAD + strlen(d->community);
+					while ((p = d->cursor) && b->count < d->maxoids &&
+					       p->interval == c->interval && p->collen == 0) {
+						/* The dotted OID is never shorter than its encoding */
+						vbsize = strlen(p->objoid) + VARBIND_OVERHEAD;
+						if (b->count > 0 && size + vbsize > set.max_pdu)
+							break;
+						size += vbsize;
+						hash.members[members++] = p;
+						p->iclass = c;
+						b->count++;
+						d->cursor = p->dnext;
+					}
+				}
+				if (d->cursor && d->cursor->interval == c->interval)
+					active[j++] = d;
+			}
+			nactive = j;
+		}
+		c->nbatches = &(hash.batches[hash.nbatches]) - c->batches;
+	}
+	free(active);
+	build_wheels();
+}
+
+
+/* Ask to send a request to d at time now.  Returns TRUE, counting the
+   request in flight, unless the device is at its in-flight limit or
+   its gap since the last request has not passed; then FALSE, with
+   *wake moved up to when it is worth asking again.  Devices without
+   limits never take the lock. */
+int device_claim(device_t *d, double now, double *wake) {
+	int ok = FALSE;
+
+	if (!d->maxinflight && !d->mingap)
+		return TRUE;
+
+	PT_MUTEX_LOCK(&(d->pace));
+	if (d->maxinflight && d->inflight >= d->maxinflight) {
+		/* Nothing tells us when a response comes in; look again soon */
+		if (now + THROTTLE_NAP < *wake)
+			*wake = now + THROTTLE_NAP;
+	} else if (now < d->next_send) {
+		if (d->next_send < *wake)
+			*wake = d->next_send;
+	} else {
+		d->inflight++;
+		d->next_send = now + d->mingap / 1000.0;
+		ok = TRUE;
+	}
+	PT_MUTEX_UNLOCK(&(d->pace));
+	return ok;
+}
+
+
+/* Count a follow-up request (split or retry of a claimed batch) in
+   flight without checking the limits */
+void device_charge(device_t *d) {
+	if (!d->maxinflight && !d->mingap)
+		return;
+	PT_MUTEX_LOCK(&(d->pace));
+	d->inflight++;
+	PT_MUTEX_UNLOCK(&(d->pace));
+}
+
+
+void device_release(device_t *d) {
+	if (!d->maxinflight && !d->mingap)
+		return;
+	PT_MUTEX_LOCK(&(d->pace));
+	d->inflight--;
+	PT_MUTEX_UNLOCK(&(d->pace));
+}
+
+
+/* Retransmission timeout in seconds: the smoothed round trip time plus
+   four deviations, within set.min_timeout and set.timeout.  Devices not
+   heard from yet get set.timeout.  Called with d->pace held. */
+double device_rto(device_t *d) {
+	double rto = set.timeout / 1000.0;
+
+	if (d->srtt > 0)
+		rto = d->srtt + 4 * d->rttvar;
+	if (rto < set.min_timeout / 1000.0)
+		rto = set.min_timeout / 1000.0;
+	if (rto > set.timeout / 1000.0)
+		rto = set.timeout / 1000.0;
+	return rto;
+}
+
+
+/* Set the timeout of the next request on sessp (if any) to d.
+   Returns it in seconds. */
+double device_timeout(device_t *d, void *sessp) {
+	struct snmp_session *session = NULL;
+	double rto;
+
+	PT_MUTEX_LOCK(&(d->pace));
+	rto = device_rto(d);
+	PT_MUTEX_UNLOCK(&(d->pace));
+	if (sessp) {
+		session = snmp_sess_session(sessp);
+		session->timeout = (long) (rto * 1000000);
+		session->retries = set.retries;
+	}
+	return rto;
+}
+
+
+/* Circuit breaker: TRUE if a request may be sent to d at time now.
+   While the breaker is open only one request per backoff period gets
+   through, to see if the device is back. */
+int device_up(device_t *d, double now) {
+	int up = TRUE;
+
+	if (!set.fail_limit)
+		return TRUE;
+	PT_MUTEX_LOCK(&(d->pace));
+	if (d->timeouts >= set.fail_limit) {
+		if (now >= d->retry_at) {
+			d->probe_at = now;
+			d->retry_at = now + d->backoff;
+		} else {
+			up = FALSE;
+		}
+	}
+	PT_MUTEX_UNLOCK(&(d->pace));
+	return up;
+}
+
+
+/* Account for the outcome of a request sent to d at time sent: update
+   the round trip time estimate as TCP does (RFC 2988), or count a
+   timeout and open the breaker (or back it off further if a probe
+   failed).  Either way the device's loss rate is brought up to date. */
+void device_result(device_t *d, int status, double sent) {
+	double now = time_now();
+	double rtt = now - sent;
+	double err;
+
+	PT_MUTEX_LOCK(&(d->pace));
+	d->loss += ((status == STAT_TIMEOUT) - d->loss) / 8;
+	if (status == STAT_TIMEOUT) {
+		d->timeouts++;
+		if (d->timeouts == set.fail_limit) {
+			d->backoff = hash.tick;
+			d->retry_at = now + d->backoff;
+			d->probe_at = now;
+			rtglog("*** Device %s not responding, skipping it for %u seconds.\n",
+				d->host, d->backoff);
+		} else if (set.fail_limit && d->timeouts > set.fail_limit && sent >= d->probe_at) {
+			d->backoff = d->backoff * 2 < MAX_BACKOFF ? d->backoff * 2 : MAX_BACKOFF;
+			d->retry_at = now + d->backoff;
+			if (set.verbose >= LOW)
+				rtglog("*** Device %s still not responding, skipping it for %u seconds.\n",
+					d->host, d->backoff);
+		}
+	} else if (status == STAT_SUCCESS) {
+		if (set.fail_limit && d->timeouts >= set.fail_limit && set.verbose >= LOW)
+			rtglog("Device %s responding again.\n", d->host);
+		d->timeouts = 0;
+		/* An answer to a retry overstates the round trip, which only
+		   makes the timeout longer */
+		if (d->srtt == 0) {
+			d->srtt = rtt;
+			d->rttvar = rtt / 2;
+		} else {
+			err = rtt > d->srtt ? rtt - d->srtt : d->srtt - rtt;
+			d->rttvar += (err - d->rttvar) / 4;
+			d->srtt += (rtt - d->srtt) / 8;
+		}
+	}
+	PT_MUTEX_UNLOCK(&(d->pace));
+}
+
+
+/* Pick the next batch worker may send now: one it put off earlier
+   that is due and whose device has become ready, else a new one from
+   the round.  New batches that are not due yet or whose device is
+   throttled are put off in deferred, up to MAX_DEFERRED of them.
+   Returns NULL if nothing can be sent yet, with *wake set to when to
+   try again; *more is cleared once the round has no unclaimed batches
+   left, or has been cut off, when what was put off is given up. */
+batch_t *claim_batch(worker_t *worker, batch_t **deferred, int *ndeferred, int *more, double *wake) {
+	crew_t *crew = worker->crew;
+	batch_t *batch = NULL;
+	double now = time_now();
+	double start = 0;
+	int i;
+
+	*wake = now + 1;
+	if (ATOMIC_ADD(&crew->closed, 0) == worker->round) {
+		while (*ndeferred > 0)
+			target_abandon(worker, deferred[--(*ndeferred)]);
+		*more = FALSE;
+		return NULL;
+	}
+	for (i = 0; i < *ndeferred; i++) {
+		if (deferred[i]->due > now) {
+			if (deferred[i]->due < *wake)
+				*wake = deferred[i]->due;
+			continue;
+		}
+		if (device_claim(deferred[i]->device, now, wake)) {
+			batch = deferred[i];
+			(*ndeferred)--;
+			memmove(&deferred[i], &deferred[i + 1], (*ndeferred - i) * sizeof(batch_t *));
+			claim_late(batch, now);
+			return batch;
+		}
+	}
+	while (*more && *ndeferred < MAX_DEFERRED) {
+		if ((batch = getNext(worker->round, &start)) == NULL) {
+			*more = FALSE;
+			break;
+		}
+		/* Its last poll is still out; one at a time */
+		if (ATOMIC_ADD(&(batch->pending), batch->count) != 0) {
+			target_abandon(worker, batch);
+			continue;
+		}
+		batch->round = worker->round;
+		batch->due = start + batch->offset;
+		/* Not due yet; neither is anything after it */
+		if (batch->due > now) {
+			deferred[(*ndeferred)++] = batch;
+			*wake = batch->due;
+			break;
+		}
+		if (device_claim(batch->device, now, wake)) {
+			claim_late(batch, now);
+			return batch;
+		}
+		deferred[(*ndeferred)++] = batch;
+	}
+	return NULL;
+}
+
+
+/* Note in the round's stats how late batch is, being sent at time now */
+void claim_late(batch_t *batch, double now) {
+	double late = now - batch->due;
+
+	PT_MUTEX_LOCK(&stats.mutex);
+	if (late > stats.late)
+		stats.late = late;
+	PT_MUTEX_UNLOCK(&stats.mutex);
+}
+
+
+/* How long a request to d is expected to take from time now: its round
+   trip if answered, all its tries if it times out, weighted by its loss
+   rate.  Devices not heard from yet are assumed to be slow, and those
+   whose breaker is open to take no time, as they are skipped. */
+double device_cost(device_t *d, double now) {
+	double cost;
+
+	PT_MUTEX_LOCK(&(d->pace));
+	if (set.fail_limit && d->timeouts >= set.fail_limit && now < d->retry_at)
+		cost = 0;
+	else if (d->srtt == 0 && d->loss == 0)
+		cost = device_rto(d);
+	else
+		cost = (1 - d->loss) * d->srtt + d->loss * device_rto(d) * (set.retries + 1);
+	PT_MUTEX_UNLOCK(&(d->pace));
+	return cost;
+}
+
+
+/* Rank the round's count batches in due for longest-first ordering.
+   A device works through its batches inflight at a time and mingap
+   apart, so each batch is ranked by how long its device should take
+   over it and those of its batches that follow it; the longest is
+   what the round cannot finish sooner than. */
+void rank_batches(batch_t **due, int count) {
+	device_t *d = NULL;
+	double now = time_now();
+	double longest = 0;
+	double cost;
+	int chain;
+	int i;
+
+	for (i = 0; i < count; i++)
+		due[i]->device->due = 0;
+	for (i = 0; i < count; i++)
+		due[i]->device->due++;
+	for (i = 0; i < count; i++) {
+		d = due[i]->device;
+		cost = device_cost(d, now);
+		chain = d->maxinflight ? (d->due + d->maxinflight - 1) / d->maxinflight : 1;
+		due[i]->rank = cost * chain + (d->due - 1) * d->mingap / 1000.0;
+		if (due[i]->rank > longest)
+			longest = due[i]->rank;
+		d->due--;
+	}
+	stats.longest = longest;
+}
@@ -7,6 +7,7 @@
 
 #include "common.h"
 #include "rtg.h"
+#include <sched.h>
 
 /* Initialize hash table */
 void init_hash() {
@@ -21,24 +22,103 @@ void init_hash() {
 }
 
 
-void init_hash_walk() {
+/* Set up the next round: queue the batches in each class's wheel slot
+   for it, which are due at their offsets from start.  Nothing is
+   claimed from it until open_hash_walk().  Returns the number of
+   targets queued, which is 0 if no class has work this round.  The
+   last round must have been closed. */
+int init_hash_walk(double start) {
+	iclass_t *c = NULL;
+	int targets = 0;
+	int classes = 0;
+	int i, j, s;
+
+	hash.ndue = 0;
+	for (i = 0; i < hash.nclasses; i++) {
+		c = &(hash.classes[i]);
+		s = hash.rounds % c->slots;
+		if (c->first[s] == c->first[s + 1])
+			continue;
+		for (j = c->first[s]; j < c->first[s + 1]; j++) {
+			hash.due[hash.ndue++] = &(c->batches[j]);
+			targets += c->batches[j].count;
+		}
+		c->rounds++;
+		classes++;
+	}
+	rank_batches(hash.due, hash.ndue);
+	/* Each slot is in offset order already */
+	if ((set.spread > 0 && classes > 1) || set.longest_first)
+		qsort(hash.due, hash.ndue, sizeof(batch_t *), compare_due);
+	hash.rounds++;
+	hash.start = start;
+	return targets;
+}
+
+
+/* Open the queue to claims made in round, the crew's generation that
+   is starting.  A straggler still at work on an earlier round gets
+   nothing from it, even if it was looking when that round was closed:
+   claims that began before round was set are waited out first. */
+void open_hash_walk(int round) {
+	ATOMIC_ADD(&(hash.round), round - hash.round);
+	while (ATOMIC_ADD(&(hash.claiming), 0) > 0)
+		sched_yield();
+	/* Open the queue only once it is all there */
 	hash.bucket = 0;
-	hash.target = hash.table[hash.bucket];
 }
 
 
-target_t *getNext() {
-	target_t *next = NULL;
+/* End the round's walk: nothing more is claimed from it, and claims
+   already under way are waited out.  Returns the number of targets in
+   the batches nobody claimed. */
+int close_hash_walk() {
+	int bucket;
+	int targets = 0;
+
+	bucket = ATOMIC_ADD(&(hash.bucket), HASH_CLOSED);
+	while (ATOMIC_ADD(&(hash.claiming), 0) > 0)
+		sched_yield();
+	for (; bucket < hash.ndue; bucket++)
+		targets += hash.due[bucket]->count;
+	return targets;
+}
+
+
+/* qsort() order for the round's batches: by offset, then if longest
+   first, by rank from the highest.  Otherwise they keep the round robin
+   order they were built in. */
+int compare_due(const void *a, const void *b) {
+	const batch_t *p = *(const batch_t **) a;
+	const batch_t *q = *(const batch_t **) b;
 
-	while (!(hash.target)) {
-		(hash.bucket)++;
-		if (hash.bucket >= HASHSIZE) 
-			return NULL;
-		hash.target = hash.table[hash.bucket];	
+	if (p->offset != q->offset)
+		return ((p->offset > q->offset) - (p->offset < q->offset));
+	if (set.longest_first && p->rank != q->rank)
+		return ((p->rank < q->rank) - (p->rank > q->rank));
+	return ((p > q) - (p < q));
+}
+
+
+/* Claim the next batch of round, setting *start to when that round
+   started.  Returns NULL once round's batches are all claimed or it
+   has been closed.  Safe to call from any number of threads without a
+   lock; claiming tells close_hash_walk() one is under way, so the
+   queue cannot be reopened for another round in the meantime. */
+batch_t *getNext(int round, double *start) {
+	batch_t *batch = NULL;
+	int bucket;
+
+	ATOMIC_ADD(&(hash.claiming), 1);
+	if (ATOMIC_ADD(&(hash.round), 0) == round) {
+		bucket = ATOMIC_ADD(&(hash.bucket), 1);
+		if (bucket < hash.ndue) {
+			batch = hash.due[bucket];
+			*start = hash.start;
+		}
 	}
-	next = hash.target;
-	hash.target = (hash.target)->next;
-	return next;
+	ATOMIC_ADD(&(hash.claiming), -1);
+	return batch;
 }
 
 
@@ -53,6 +133,8 @@ void free_hash() {
 		while (ptr) {
 			f = ptr;
 			ptr = ptr->next;
+			free(f->anOID);
+			free(f->ber);
 			free(f);	
 		}	
 	}
@@ -194,6 +276,8 @@ int del_hash_entry(target_t *new) {
 				else 
 					hash.table[key] = NULL;
 			}
+			free(p->anOID);
+			free(p->ber);
 			free (p);
 			return TRUE;
 		}
@@ -204,7 +288,9 @@ int del_hash_entry(target_t *new) {
 }
 
 
-/* Add an entry to hash if it is unique, otherwise free() it */
+/* Add an entry to hash if it is unique, otherwise free() it.  New
+   entries have their OID parsed here, once; an entry whose OID does
+   not parse is dropped. */
 int add_hash_entry(target_t *new) {
     target_t *p = NULL;
 	unsigned int key;
@@ -215,9 +301,16 @@ int add_hash_entry(target_t *new) {
 	p = in_hash(new, hash.table[key]);
 	if (p) {
 		p->init = LIVE;
+		p->interval = new->interval;
 		free(new);
 		return FALSE;
 	} 
+	if (!target_oid(new)) {
+		printf("*** Unparsable OID %s for %s, target ignored.\n",
+			new->objoid, new->host);
+		free(new);
+		return FALSE;
+	}
 
 	if (!hash.table[key]) {
 		hash.table[key] = new;
@@ -235,12 +328,19 @@ int add_hash_entry(target_t *new) {
    polling.  hash_target_file() can be called again to update the target
    hash.  If hash_target_file() finds new target entries in the file, it
    adds them to the hash.  If hash_target_file() finds entries in hash
-   but not in file, it removes said entries from hash.  */
+   but not in file, it removes said entries from hash.  A target with an
+   "interval=<seconds>" column is polled that often instead of every
+   set.interval.  Lines of the form "device <host> key=value ..." set
+   per-device polling options. */
 int hash_target_file(char *file) {
     FILE *fp;
     target_t *new = NULL;
+    devopt_t *devopts = NULL;
+    devopt_t *opt = NULL;
+    device_t scratch;
     char buffer[BUFSIZE];
     char maxspeed[30];
+    char interval[30];
     int entries = 0;
     int removed = 0;
 
@@ -257,15 +357,46 @@ int hash_target_file(char *file) {
 	while (!feof(fp)) {
 		fgets(buffer, BUFSIZE, fp);
 		if (!feof(fp) && buffer[0] != '#' && buffer[0] != ' ' && buffer[0] != '\n') {
+			if (!strncasecmp(buffer, "device", 6) && isspace((int) buffer[6])) {
+				opt = (devopt_t *) malloc(sizeof(devopt_t));
+				if (!opt) {
+					printf("Fatal device malloc error!\n");
+					exit(-1);
+				}
+				opt->host[0] = opt->opts[0] = '\0';
+				sscanf(buffer, "%*s %63s %511[^\n]", opt->host, opt->opts);
+				/* Check the options once here so errors show up at load;
+				   build_devices() applies them without a word */
+				memset(&scratch, 0, sizeof(scratch));
+				strncpy(scratch.host, opt->host, sizeof(scratch.host));
+				device_options(&scratch, opt->opts, FALSE);
+				opt->next = devopts;
+				devopts = opt;
+				continue;
+			}
 			new = (target_t *) malloc(sizeof(target_t));
 			if (!new) {
 				printf("Fatal target malloc error!\n");
 				exit(-1);
 			}
-			sscanf(buffer, "%64s %128s %hu %64s %64s %d %30s",
+			maxspeed[0] = interval[0] = '\0';
+			sscanf(buffer, "%63s %127s %hu %63s %63s %d %29s %29s",
 			       new->host, new->objoid, &(new->bits),
 			       new->community, new->table,
-			       &(new->iid), maxspeed);
+			       &(new->iid), maxspeed, interval);
+			/* interval=seconds may follow the ID or the maximum */
+			if (!strncasecmp(maxspeed, "interval=", 9)) {
+				strncpy(interval, maxspeed, sizeof(interval));
+				maxspeed[0] = '\0';
+			}
+			new->interval = set.interval;
+			if (!strncasecmp(interval, "interval=", 9)) {
+				if (alldigits(interval + 9) && atoi(interval + 9) > 0)
+					new->interval = atoi(interval + 9);
+				else
+					printf("*** Invalid interval for %s@%s: %s\n",
+						new->host, new->objoid, interval + 9);
+			}
 			if (alldigits(maxspeed)) {
 #ifdef HAVE_STRTOLL
 				new->maxspeed = strtoll(maxspeed, NULL, 0);
@@ -276,21 +407,37 @@ int hash_target_file(char *file) {
 				new->maxspeed = set.out_of_range;
 			}
 			if (set.verbose > DEBUG) 
-				printf("Host[OID][OutOfRange]:%s[%s][%lld]\n",
-				       new->host, new->objoid, new->maxspeed);
+				printf("Host[OID][OutOfRange][Interval]:%s[%s][%lld][%u]\n",
+				       new->host, new->objoid, new->maxspeed, new->interval);
+			new->anOID = NULL;
+			new->anOID_len = 0;
+			new->ber = NULL;
+			new->ber_len = 0;
 			new->init = NEW;
 			new->last_value = 0;
+			new->iclass = NULL;
+			new->device = NULL;
+			new->dnext = NULL;
 			new->next = NULL;
 			entries += add_hash_entry(new);
 		}
 	}
 	fclose(fp);
 	removed = delete_targets(STALE);
+	build_devices(devopts);
+	free_devopts(devopts);
+	session_sweep();
+	build_batches();
 	if (set.verbose >= LOW) {
 		printf("Successfully hashed [%d] new targets, (%d bytes).\n",
 			entries, entries * sizeof(target_t));
 		if (removed > 0)
 			printf("Removed [%d] stale targets from hash.\n", removed);
+		printf("Polling [%d] targets in [%d] requests.\n", hash.ntargets,
+			hash.nbatches);
+		if (hash.nclasses > 1)
+			printf("Polling [%d] intervals in rounds of %u seconds.\n",
+				hash.nclasses, hash.tick);
 	}
 	return (entries);
 }
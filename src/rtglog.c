@@ -0,0 +1,274 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG poller logging
+****************************************************************************/
+
+#include "common.h"
+#include "rtg.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <syslog.h>
+
+/* Messages from the polling threads are formatted into a ring of the
+   thread's own, which never blocks it: a full ring loses the message
+   and counts it.  The log thread takes them from every ring, oldest
+   first, every LOG_NAP seconds and writes them out to set.log, which
+   is stdout, syslog or a file.  Repeats of a message are written once
+   with a count, and at most set.log_rate messages go out a second.
+   Other threads write through the log thread's path directly, after
+   what is in the rings. */
+
+logger_t logger = {PTHREAD_MUTEX_INITIALIZER};
+
+
+/* Open set.log and start the log thread.  Until then messages are just
+   printed. */
+void log_init()
+{
+    pthread_t thread;
+
+    if (!strcasecmp(set.log, "syslog")) {
+	openlog("rtgpoll", LOG_PID, LOG_DAEMON);
+	logger.syslog = TRUE;
+    } else if (strcasecmp(set.log, "stdout")) {
+	if ((logger.fp = fopen(set.log, "a")) == NULL) {
+	    printf("*** Could not open log file '%s': %s\n", set.log, strerror(errno));
+	    exit(-1);
+	}
+    }
+    if (pthread_key_create(&logger.key, NULL) != 0 ||
+	pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+	printf("Fatal log thread error!\n");
+	exit(-1);
+    }
+    logger.on = TRUE;
+}
+
+
+/* Return the log ring of worker index, making one if there is none
+   yet.  A ring passes to the next worker with the index, and is never
+   freed.  Only called by main(). */
+logring_t *log_ring(int index)
+{
+    logring_t **rings = NULL;
+    logring_t *ring = NULL;
+
+    PT_MUTEX_LOCK(&logger.mutex);
+    while (logger.nrings <= index) {
+	rings = (logring_t **) realloc(logger.rings, (logger.nrings + 1) * sizeof(logring_t *));
+	ring = (logring_t *) malloc(sizeof(logring_t));
+	if (!rings || !ring) {
+	    printf("Fatal log malloc error!\n");
+	    exit(-1);
+	}
+	memset(ring, 0, sizeof(logring_t));
+	logger.rings = rings;
+	logger.rings[logger.nrings++] = ring;
+    }
+    ring = logger.rings[index];
+    PT_MUTEX_UNLOCK(&logger.mutex);
+    return ring;
+}
+
+
+/* Log the calling thread's messages to ring */
+void log_attach(logring_t *ring)
+{
+    if (logger.on)
+	pthread_setspecific(logger.key, ring);
+}
+
+
+/* Log a printf() style message.  Messages starting with "***" are
+   warnings. */
+void rtglog(const char *fmt, ...)
+{
+    logring_t *ring = NULL;
+    logline_t *line = NULL;
+    va_list ap;
+    char text[LOG_LINE];
+    int head, tail;
+
+    va_start(ap, fmt);
+    if (!logger.on) {
+	vprintf(fmt, ap);
+	va_end(ap);
+	return;
+    }
+    if ((ring = (logring_t *) pthread_getspecific(logger.key)) == NULL) {
+	vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	PT_MUTEX_LOCK(&logger.mutex);
+	log_drain();
+	log_emit(time_now(), text);
+	log_out(0, NULL);
+	PT_MUTEX_UNLOCK(&logger.mutex);
+	return;
+    }
+
+    /* head and tail run modulo twice the ring, so a full ring and an
+       empty one differ */
+    head = ATOMIC_ADD(&ring->head, 0);
+    tail = ATOMIC_ADD(&ring->tail, 0);
+    if ((head - tail + 2 * LOG_SLOTS) % (2 * LOG_SLOTS) == LOG_SLOTS) {
+	va_end(ap);
+	COUNT(ring->lost, 1);
+	return;
+    }
+    line = &(ring->line[head % LOG_SLOTS]);
+    vsnprintf(line->text, sizeof(line->text), fmt, ap);
+    va_end(ap);
+    line->when = time_now();
+    ATOMIC_ADD(&ring->head, (head + 1) % (2 * LOG_SLOTS) - head);
+}
+
+
+/* The log thread */
+void *log_thread(void *arg)
+{
+    while (1) {
+	usleep((unsigned int) (LOG_NAP * 1000000));
+	log_flush();
+    }
+    return NULL;
+}
+
+
+/* Write out everything logged so far */
+void log_flush()
+{
+    if (!logger.on)
+	return;
+    PT_MUTEX_LOCK(&logger.mutex);
+    log_drain();
+    if (logger.repeats > 0 && time_now() >= logger.repeat_at + LOG_REPEAT)
+	log_repeats();
+    log_out(0, NULL);
+    PT_MUTEX_UNLOCK(&logger.mutex);
+}
+
+
+/* Take the messages in the rings, oldest first.  Called with
+   logger.mutex held. */
+void log_drain()
+{
+    logring_t *ring = NULL;
+    logline_t *line = NULL;
+    logline_t *oldest = NULL;
+    unsigned long long lost;
+    int i, tail, from = 0;
+
+    while (1) {
+	oldest = NULL;
+	for (i = 0; i < logger.nrings; i++) {
+	    ring = logger.rings[i];
+	    tail = ATOMIC_ADD(&ring->tail, 0);
+	    if (tail == ATOMIC_ADD(&ring->head, 0))
+		continue;
+	    line = &(ring->line[tail % LOG_SLOTS]);
+	    if (!oldest || line->when < oldest->when) {
+		oldest = line;
+		from = i;
+	    }
+	}
+	if (!oldest)
+	    break;
+	log_emit(oldest->when, oldest->text);
+	ring = logger.rings[from];
+	tail = ATOMIC_ADD(&ring->tail, 0);
+	ATOMIC_ADD(&ring->tail, (tail + 1) % (2 * LOG_SLOTS) - tail);
+    }
+
+    for (i = 0; i < logger.nrings; i++) {
+	lost = COUNTED(logger.rings[i]->lost);
+	if (lost > logger.rings[i]->reported) {
+	    snprintf(logger.text, sizeof(logger.text),
+		"*** Thread [%d] lost %llu log messages, log ring full.\n",
+		i, lost - logger.rings[i]->reported);
+	    logger.rings[i]->reported = lost;
+	    log_emit(time_now(), logger.text);
+	}
+    }
+}
+
+
+/* Write out a message logged at time when, unless it repeats the last
+   one or there have been set.log_rate this second already.  Called with
+   logger.mutex held. */
+void log_emit(double when, const char *text)
+{
+    if (!strcmp(text, logger.last)) {
+	if (logger.repeats++ == 0)
+	    logger.repeat_at = when;
+	return;
+    }
+    if (logger.repeats > 0)
+	log_repeats();
+
+    if (set.log_rate) {
+	if ((long) when != logger.second) {
+	    if (logger.dropped > 0) {
+		snprintf(logger.text, sizeof(logger.text),
+		    "*** %u log messages dropped, over LogRate.\n", logger.dropped);
+		log_out(when, logger.text);
+	    }
+	    logger.second = (long) when;
+	    logger.count = 0;
+	    logger.dropped = 0;
+	}
+	if (++(logger.count) > set.log_rate) {
+	    /* What follows does not repeat what was written */
+	    logger.last[0] = '\0';
+	    logger.dropped++;
+	    return;
+	}
+    }
+    strncpy(logger.last, text, sizeof(logger.last) - 1);
+    logger.repeats = 0;
+    log_out(when, text);
+}
+
+
+/* Say how many times the last message was repeated.  Called with
+   logger.mutex held. */
+void log_repeats()
+{
+    char text[64];
+
+    snprintf(text, sizeof(text), "Last message repeated %d time%s.\n",
+	logger.repeats, logger.repeats > 1 ? "s" : "");
+    logger.repeats = 0;
+    log_out(logger.repeat_at, text);
+}
+
+
+/* Write text, logged at time when, to set.log; with no text, flush
+   what has been written.  Called with logger.mutex held. */
+void log_out(double when, const char *text)
+{
+    FILE *fp = logger.fp ? logger.fp : stdout;
+    char stamp[32];
+    time_t secs;
+    size_t len;
+
+    if (!text) {
+	if (!logger.syslog)
+	    fflush(fp);
+	return;
+    }
+    if (logger.syslog) {
+	/* syslog() ends the line itself */
+	len = strlen(text);
+	while (len > 0 && text[len - 1] == '\n')
+	    len--;
+	syslog(strncmp(text, "***", 3) ? LOG_INFO : LOG_WARNING, "%.*s", (int) len, text);
+    } else if (logger.fp) {
+	secs = (time_t) when;
+	strftime(stamp, sizeof(stamp), "%m/%d %H:%M:%S", localtime(&secs));
+	fprintf(fp, "[%s] %s", stamp, text);
+    } else {
+	fputs(text, fp);
+    }
+}
@@ -41,3 +41,195 @@ void rtg_dbdisconnect(MYSQL * mysql)
 {
     mysql_close(mysql);
 }
+
+
+/* Return the statement in cache inserting rows rows into table,
+   preparing it on mysql if there is none.  The one found is moved to
+   the front, and past DB_STMT_CACHE of them the least recently used is
+   closed.  NULL if it could not be prepared; mysql_error() says why. */
+dbstmt_t *db_prepare(MYSQL * mysql, dbstmt_t **cache, int *ncached, char *table, int rows)
+{
+    dbstmt_t *st = NULL;
+    dbstmt_t *prev = NULL;
+    MYSQL_BIND *b = NULL;
+    char *query = NULL;
+    size_t len;
+    int i;
+
+    for (st = *cache; st; prev = st, st = st->next) {
+	if (st->rows == rows && !strcmp(st->table, table)) {
+	    if (prev) {
+		prev->next = st->next;
+		st->next = *cache;
+		*cache = st;
+	    }
+	    return st;
+	}
+    }
+
+    st = (dbstmt_t *) calloc(1, sizeof(dbstmt_t));
+    if (st) {
+	st->bind = (MYSQL_BIND *) calloc(3 * rows, sizeof(MYSQL_BIND));
+	st->param = (dbparam_t *) calloc(rows, sizeof(dbparam_t));
+	query = (char *) malloc(strlen(table) + 32 + rows * 32);
+    }
+    if (!st || !st->bind || !st->param || !query) {
+	printf("Fatal statement malloc error!\n");
+	exit(-1);
+    }
+    strncpy(st->table, table, sizeof(st->table) - 1);
+    st->rows = rows;
+    len = sprintf(query, "INSERT INTO %s VALUES ", table);
+    for (i = 0; i < rows; i++)
+	len += sprintf(query + len, "%s(?, FROM_UNIXTIME(?), ?)", i ? "," : "");
+
+    for (i = 0; i < rows; i++) {
+	b = &(st->bind[3 * i]);
+	b[0].buffer_type = MYSQL_TYPE_LONG;
+	b[0].buffer = (char *) &(st->param[i].iid);
+	if (set.dbsubsecond) {
+	    b[1].buffer_type = MYSQL_TYPE_DOUBLE;
+	    b[1].buffer = (char *) &(st->param[i].received);
+	} else {
+	    b[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	    b[1].buffer = (char *) &(st->param[i].secs);
+	}
+	b[2].buffer_type = MYSQL_TYPE_LONGLONG;
+	b[2].buffer = (char *) &(st->param[i].value);
+	b[2].is_unsigned = TRUE;
+    }
+
+    if ((st->stmt = mysql_stmt_init(mysql)) == NULL ||
+	mysql_stmt_prepare(st->stmt, query, len) ||
+	mysql_stmt_bind_param(st->stmt, st->bind)) {
+	free(query);
+	db_stmt_free(st);
+	return NULL;
+    }
+    free(query);
+
+    st->next = *cache;
+    *cache = st;
+    if (++(*ncached) > DB_STMT_CACHE) {
+	for (prev = *cache; prev->next->next; prev = prev->next)
+	    ;
+	db_stmt_free(prev->next);
+	prev->next = NULL;
+	(*ncached)--;
+    }
+    return st;
+}
+
+
+/* Insert the st->rows rows from row through st.  Returns 0 if they
+   were; mysql_stmt_error() says why not. */
+int db_execute(dbstmt_t *st, dbrow_t *row)
+{
+    dbparam_t *p = st->param;
+    int i;
+
+    for (i = 0; i < st->rows; i++, p++, row++) {
+	p->iid = row->iid;
+	p->received = row->received;
+	p->secs = (long long) row->received;
+	p->value = row->value;
+    }
+    return (mysql_stmt_execute(st->stmt));
+}
+
+
+/* Close every statement in cache, as before its connection is closed */
+void db_unprepare(dbstmt_t **cache, int *ncached)
+{
+    dbstmt_t *st = NULL;
+
+    while ((st = *cache) != NULL) {
+	*cache = st->next;
+	db_stmt_free(st);
+    }
+    *ncached = 0;
+}
+
+
+void db_stmt_free(dbstmt_t *st)
+{
+    if (st->stmt)
+	mysql_stmt_close(st->stmt);
+    free(st->bind);
+    free(st->param);
+    free(st);
+}
+
+
+/* LOAD DATA LOCAL INFILE rows rows from row into table on mysql.  There
+   is no file: the library reads the rows through the db_infile_*()
+   handlers, as lines of tab separated id, time and counter.  Returns 0
+   if the statement ran; mysql_affected_rows() says how many rows went
+   in, as the server skips those it cannot take. */
+int db_load(MYSQL * mysql, char *table, dbrow_t *row, int rows)
+{
+    dbload_t load;
+    char query[BUFSIZE];
+
+    memset(&load, 0, sizeof(load));
+    load.row = row;
+    load.rows = rows;
+    snprintf(query, sizeof(query), "LOAD DATA LOCAL INFILE 'rtgpoll' INTO TABLE %s "
+	"(id, @dtime, counter) SET dtime = FROM_UNIXTIME(@dtime)", table);
+    mysql_set_local_infile_handler(mysql, db_infile_init, db_infile_read,
+	db_infile_end, db_infile_error, &load);
+    return (mysql_query(mysql, query));
+}
+
+
+int db_infile_init(void **ptr, const char *filename, void *userdata)
+{
+    *ptr = userdata;
+    return (0);
+}
+
+
+/* Fill buf with up to len bytes more of the load's lines.  Returns how
+   many; 0 once they have all gone. */
+int db_infile_read(void *ptr, char *buf, unsigned int len)
+{
+    dbload_t *load = (dbload_t *) ptr;
+    dbrow_t *r = NULL;
+    unsigned int n = 0;
+    unsigned int take;
+
+    while (n < len) {
+	if (load->at == load->len) {
+	    if (load->next == load->rows)
+		break;
+	    r = &(load->row[load->next++]);
+	    if (set.dbsubsecond)
+		load->len = snprintf(load->line, sizeof(load->line), "%d\t%.6f\t%llu\n",
+		    r->iid, r->received, r->value);
+	    else
+		load->len = snprintf(load->line, sizeof(load->line), "%d\t%ld\t%llu\n",
+		    r->iid, (long) r->received, r->value);
+	    load->at = 0;
+	}
+	take = load->len - load->at;
+	if (take > len - n)
+	    take = len - n;
+	memcpy(buf + n, load->line + load->at, take);
+	load->at += take;
+	n += take;
+    }
+    return (n);
+}
+
+
+void db_infile_end(void *ptr)
+{
+}
+
+
+/* Never called, as reading the rows cannot fail */
+int db_infile_error(void *ptr, char *msg, unsigned int len)
+{
+    snprintf(msg, len, "rtgpoll infile error");
+    return (2000);		/* CR_UNKNOWN_ERROR */
+}
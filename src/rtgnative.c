@@ -0,0 +1,541 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG native SNMP poll engine
+****************************************************************************/
+
+/* sendmmsg() and recvmmsg() are GNU extensions */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE 1
+#endif
+
+#include "common.h"
+#include "rtg.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_RECVMMSG
+# define NATIVE_RECV_BATCH NATIVE_BATCH
+#else
+# define NATIVE_RECV_BATCH 1
+#endif
+
+
+/* Work out where the native engine sends d's requests.  Returns FALSE
+   for hosts it cannot reach itself (transport specifiers such as
+   "udp6:" or "tcp:", or names that do not resolve to IPv4); their
+   targets are polled through net-snmp instead. */
+int native_addr(device_t *d)
+{
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+
+    memset(&(d->addr), 0, sizeof(d->addr));
+    if (strchr(d->host, ':'))
+	return FALSE;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(d->host, NULL, &hints, &res) != 0 || !res)
+	return FALSE;
+    memcpy(&(d->addr), res->ai_addr, sizeof(d->addr));
+    d->addr.sin_port = htons(d->port);
+    freeaddrinfo(res);
+    return TRUE;
+}
+
+
+/* Open a thread's non-blocking UDP socket, with the configured buffer
+   sizes and, where the kernel can, a count of receive buffer drops and
+   the time each datagram arrived */
+int native_socket()
+{
+    int sock, on = 1;
+    int size;
+    socklen_t len = sizeof(size);
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+	printf("Fatal native engine socket error: %s\n", strerror(errno));
+	exit(-1);
+    }
+    size = set.sndbuf;
+    if (size && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0)
+	rtglog("*** Could not set SNMP_SndBuf to %d: %s\n", size, strerror(errno));
+    size = set.rcvbuf;
+    if (size && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+	rtglog("*** Could not set SNMP_RcvBuf to %d: %s\n", size, strerror(errno));
+#ifdef SO_RXQ_OVFL
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0 && set.verbose >= HIGH)
+	rtglog("*** Receive buffer drops will not be counted: %s\n", strerror(errno));
+#endif
+#ifdef SO_TIMESTAMPNS
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0 && set.verbose >= HIGH)
+	rtglog("*** Responses will be stamped when read: %s\n", strerror(errno));
+#endif
+    /* The kernel may cap, round or double what was asked for */
+    if (set.verbose >= HIGH && getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0)
+	rtglog("Native engine socket receive buffer is %d bytes.\n", size);
+    return sock;
+}
+
+
+/* Poll a batch through net-snmp, without holding up what is queued */
+void native_fallback(native_t *n, batch_t *batch)
+{
+    native_flush(n);
+    poll_sync(n->worker, batch);
+}
+
+
+/* A request could not be sent, for reason err.  A first try has its
+   batch polled through net-snmp, which will report why; a lost retry
+   is left to its timer. */
+void native_failed(native_t *n, native_request_t *req, int err)
+{
+    batch_t *batch = NULL;
+
+    if (set.verbose >= HIGH)
+	rtglog("*** Native send to %s failed: %s\n", req->batch->device->host, strerror(err));
+    if (req->tries == 0 && err != EAGAIN && err != EWOULDBLOCK && err != ENOBUFS) {
+	batch = req->batch;
+	req->batch = NULL;
+	n->worker->inflight--;
+	native_fallback(n, batch);
+    }
+}
+
+
+/* Send the queued requests, as many per system call as the kernel
+   takes */
+void native_flush(native_t *n)
+{
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[NATIVE_BATCH];
+#endif
+    int err[NATIVE_BATCH];
+    int nout = n->nout;
+    int i, j, count;
+    int sent = 0;
+    size_t bytes = 0;
+
+    /* Empty the queue first; native_fallback() below flushes too */
+    n->nout = 0;
+    n->outlen = 0;
+    if (n->uring && nout > 0) {
+	sent = uring_send(n, nout, err);
+	for (i = 0; i < nout; i++) {
+	    if (err[i])
+		native_failed(n, n->outreq[i], err[i]);
+	    else
+		bytes += n->outiov[i].iov_len;
+	}
+	nout = 0;
+    }
+#ifdef HAVE_SENDMMSG
+    memset(msgs, 0, nout * sizeof(struct mmsghdr));
+    for (i = 0; i < nout; i++) {
+	msgs[i].msg_hdr.msg_name = &(n->outreq[i]->batch->device->addr);
+	msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	msgs[i].msg_hdr.msg_iov = &(n->outiov[i]);
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+    for (i = 0; i < nout; i += count) {
+#ifdef HAVE_SENDMMSG
+	count = sendmmsg(n->sock, &msgs[i], nout - i, 0);
+#else
+	count = sendto(n->sock, n->outiov[i].iov_base, n->outiov[i].iov_len, 0,
+		       (struct sockaddr *) &(n->outreq[i]->batch->device->addr),
+		       sizeof(struct sockaddr_in)) < 0 ? -1 : 1;
+#endif
+	if (count > 0) {
+	    for (j = i; j < i + count; j++)
+		bytes += n->outiov[j].iov_len;
+	    sent += count;
+	    continue;
+	}
+	native_failed(n, n->outreq[i], errno);
+	count = 1;
+    }
+
+    COUNT(n->worker->counters->sent, sent);
+    COUNT(n->worker->counters->bytes_sent, bytes);
+}
+
+
+/* Encode req's batch into the send queue, flushing it when full.
+   Retries are encoded afresh rather than kept.  Returns FALSE if the
+   batch cannot be encoded. */
+int native_transmit(native_t *n, native_request_t *req)
+{
+    batch_t *batch = req->batch;
+    u_char *msg = NULL;
+    size_t len;
+
+    msg = ber_get(n->out + n->outlen, NATIVE_BUFSIZE - n->outlen, batch->device,
+		  req->reqid, batch->targets, batch->count, &len);
+    if (!msg && n->nout > 0) {
+	native_flush(n);
+	msg = ber_get(n->out, NATIVE_BUFSIZE, batch->device, req->reqid,
+		      batch->targets, batch->count, &len);
+    }
+    if (!msg)
+	return FALSE;
+    /* ber_get() writes at the end of the space it is given */
+    memmove(n->out + n->outlen, msg, len);
+    n->outiov[n->nout].iov_base = n->out + n->outlen;
+    n->outiov[n->nout].iov_len = len;
+    n->outreq[n->nout++] = req;
+    n->outlen += len;
+    if (n->nout == NATIVE_BATCH)
+	native_flush(n);
+    return TRUE;
+}
+
+
+/* Send a GET for a claimed batch.  Returns FALSE if the batch has to
+   go through net-snmp instead. */
+int native_send(native_t *n, batch_t *batch)
+{
+    native_request_t *req = NULL;
+    int slot;
+
+    if (batch->bulk || !batch->device->native)
+	return FALSE;
+    for (slot = n->next; n->req[slot].batch; slot = (slot + 1) % set.window)
+	;
+    req = &(n->req[slot]);
+    req->batch = batch;
+    req->reqid = (long) (((++n->serial) << NATIVE_SLOT_BITS | slot) & 0x7fffffff);
+    req->tries = 0;
+    req->sent = time_now();
+    req->expires = req->sent + device_timeout(batch->device, NULL);
+    n->next = (slot + 1) % set.window;
+    n->worker->inflight++;
+    if (!native_transmit(n, req)) {
+	req->batch = NULL;
+	n->worker->inflight--;
+	return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* Match a datagram to the request it answers and process its values.
+   As with net-snmp the request-id alone decides, since agents on
+   multi-homed devices may answer from another address.  Anything that
+   is not a clean answer (an error status, an exception or a type we do
+   not decode) has the batch polled again through net-snmp so it is
+   handled and reported as the other engines do.  The values are
+   stamped with received, when the datagram arrived. */
+void native_receive(native_t *n, const u_char *msg, size_t len, struct sockaddr_in *from, double received)
+{
+    worker_t *worker = n->worker;
+    native_request_t *req = NULL;
+    batch_t *batch = NULL;
+    unsigned long long values[MAX_OIDS];
+    const u_char *vbl = NULL;
+    size_t vblen;
+    long reqid, errstat;
+    int slot;
+
+    COUNT(worker->counters->bytes_received, len);
+    if (!ber_response(msg, len, &reqid, &errstat, &vbl, &vblen)) {
+	if (set.verbose >= HIGH)
+	    rtglog("*** Unparsable SNMP response from %s\n", inet_ntoa(from->sin_addr));
+	return;
+    }
+    /* Drop strays and late answers to requests already answered or
+       given up on */
+    slot = reqid & ((1 << NATIVE_SLOT_BITS) - 1);
+    if (slot >= set.window)
+	return;
+    req = &(n->req[slot]);
+    if (!(batch = req->batch) || req->reqid != reqid)
+	return;
+
+    req->batch = NULL;
+    worker->inflight--;
+    device_result(batch->device, STAT_SUCCESS, req->sent);
+    if (errstat == SNMP_ERR_NOERROR &&
+	ber_values(vbl, vblen, batch->targets, batch->count, values)) {
+	device_release(batch->device);
+	process_values(worker, batch->targets, batch->count, values, received);
+	target_done(worker, batch, batch->count);
+    } else {
+	if (set.verbose >= HIGH)
+	    rtglog("Thread [%d] passing %s (%d OIDs) to net-snmp\n", worker->index, batch->device->host, batch->count);
+	native_fallback(n, batch);
+    }
+}
+
+
+/* Read the datagrams waiting on the socket, NATIVE_RECV_BATCH per
+   system call, and process them.  Returns how many were read. */
+int native_drain(native_t *n)
+{
+    struct sockaddr_in from[NATIVE_RECV_BATCH];
+    struct iovec iov[NATIVE_RECV_BATCH];
+    char control[NATIVE_RECV_BATCH][NATIVE_CONTROL];
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[NATIVE_RECV_BATCH];
+#else
+    struct {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+    } msgs[NATIVE_RECV_BATCH];
+#endif
+    unsigned int drops = n->drops;
+    double received;
+    int count, i;
+
+    if (n->uring)
+	return uring_drain(n);
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < NATIVE_RECV_BATCH; i++) {
+	iov[i].iov_base = n->in + i * NATIVE_BUFSIZE;
+	iov[i].iov_len = NATIVE_BUFSIZE;
+	msgs[i].msg_hdr.msg_name = &from[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+	msgs[i].msg_hdr.msg_control = control[i];
+	msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+#ifdef HAVE_RECVMMSG
+    count = recvmmsg(n->sock, msgs, NATIVE_RECV_BATCH, 0, NULL);
+#else
+    if ((count = recvmsg(n->sock, &(msgs[0].msg_hdr), 0)) >= 0) {
+	msgs[0].msg_len = count;
+	count = 1;
+    }
+#endif
+    if (count < 0) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    set.verbose >= HIGH)
+	    rtglog("*** Native receive error: %s\n", strerror(errno));
+	return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+	native_control(&(msgs[i].msg_hdr), &drops, &received);
+	native_receive(n, iov[i].iov_base, msgs[i].msg_len, &from[i], received);
+    }
+    native_count(n, count, drops);
+    return count;
+}
+
+
+/* Read the ancillary data of a received datagram: the kernel's running
+   count of drops for the socket into drops, if it sent one, and the
+   time the datagram arrived into received, or failing that the time
+   now */
+void native_control(struct msghdr *msg, unsigned int *drops, double *received)
+{
+    struct cmsghdr *cmsg = NULL;
+    struct timespec ts;
+
+    *received = 0;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+	if (cmsg->cmsg_level != SOL_SOCKET)
+	    continue;
+#ifdef SO_RXQ_OVFL
+	if (cmsg->cmsg_type == SO_RXQ_OVFL)
+	    memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+#endif
+#ifdef SCM_TIMESTAMPNS
+	if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+	    memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+	    *received = ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+#endif
+    }
+    if (*received == 0)
+	*received = time_now();
+}
+
+
+/* Add count datagrams read to the stats, and any rise in the socket's
+   drop count, which is now drops */
+void native_count(native_t *n, int count, unsigned int drops)
+{
+    COUNT(n->worker->counters->received, count);
+    if (drops > n->drops)
+	COUNT(n->worker->counters->drops, drops - n->drops);
+    if (drops > n->drops && set.verbose >= HIGH)
+	rtglog("*** Thread [%d] socket dropped %u SNMP responses, receive buffer full.\n",
+	    n->worker->index, drops - n->drops);
+    n->drops = drops;
+}
+
+
+/* Retransmit or time out the requests whose timer ran out by now.
+   Returns when the next one runs out. */
+double native_expire(native_t *n, double now)
+{
+    worker_t *worker = n->worker;
+    native_request_t *req = NULL;
+    batch_t *batch = NULL;
+    double next = now + 1;
+    int slot, i;
+
+    for (slot = 0; slot < set.window; slot++) {
+	req = &(n->req[slot]);
+	if (!(batch = req->batch))
+	    continue;
+	if (req->expires <= now) {
+	    if (req->tries < set.retries) {
+		req->tries++;
+		COUNT(worker->counters->retries, 1);
+		req->expires = now + device_timeout(batch->device, NULL);
+		native_transmit(n, req);
+		if (!req->batch)
+		    continue;
+	    } else {
+		req->batch = NULL;
+		worker->inflight--;
+		device_release(batch->device);
+		device_result(batch->device, STAT_TIMEOUT, req->sent);
+		for (i = 0; i < batch->count; i++)
+		    process_result(worker, batch->targets[i], STAT_TIMEOUT, NULL, NULL, 0);
+		target_done(worker, batch, batch->count);
+		continue;
+	    }
+	}
+	if (req->expires < next)
+	    next = req->expires;
+    }
+    native_flush(n);
+    return next;
+}
+
+
+/* Native poll engine.  Like the async engine each thread keeps up to
+   set.window GETs in flight, but they are encoded from the targets'
+   pre-encoded OIDs into one buffer, sent on one UDP socket per thread
+   and their answers decoded straight into counter values, with no
+   allocation per request.  Walks, and devices or answers the engine
+   does not handle, are polled through net-snmp by the same thread. */
+void *native_poller(void *thread_args)
+{
+    worker_t *worker = (worker_t *) thread_args;
+    native_t n;
+    batch_t *batch = NULL;
+    batch_t *deferred[MAX_DEFERRED];
+    struct timeval timeout;
+    fd_set fdset;
+    double wake, nap, expires, waited;
+    int more, ndeferred, fd, i;
+
+    log_attach(worker->log);
+    if (set.verbose >= HIGH)
+	rtglog("Thread [%d] starting (native, window %d).\n", worker->index, set.window);
+    if (MYSQL_VERSION_ID > 40000)
+       mysql_thread_init();
+    else
+       my_thread_init();
+
+    memset(&n, 0, sizeof(n));
+    n.worker = worker;
+    n.req = (native_request_t *) calloc(set.window, sizeof(native_request_t));
+    n.out = (u_char *) malloc(NATIVE_BUFSIZE);
+    n.outiov = (struct iovec *) malloc(NATIVE_BATCH * sizeof(struct iovec));
+    /* Only the pages datagrams are read into get touched */
+    n.in = (u_char *) malloc(NATIVE_RECV_BATCH * NATIVE_BUFSIZE);
+    if (!n.req || !n.out || !n.outiov || !n.in) {
+	printf("Fatal native engine malloc error!\n");
+	exit(-1);
+    }
+    n.sock = native_socket();
+    if (set.io == URING_IO)
+	n.uring = uring_open(n.sock);
+    worker->inflight = 0;
+
+    while (1) {
+	if (set.verbose >= DEVELOP)
+	    rtglog("Thread [%d] idle, waiting on round start\n", worker->index);
+	if (!round_wait(worker))
+	    break;
+
+	more = TRUE;
+	ndeferred = 0;
+	while (more || ndeferred > 0 || worker->inflight > 0) {
+	    db_flush(worker, FALSE);
+	    /* Answers still owed from a round that was cut off need not
+	       keep us from the next one */
+	    if (!more && ndeferred == 0 && round_started(worker))
+		more = TRUE;
+	    /* Top up the window from the shared queue */
+	    while (worker->inflight < set.window &&
+		   (batch = claim_batch(worker, deferred, &ndeferred, &more, &wake)) != NULL) {
+		if (set.verbose >= HIGH)
+		    rtglog("Thread [%d] processing %s (%d OIDs) (%d in flight)\n", worker->index, batch->device->host, batch->count, worker->inflight);
+		if (!device_up(batch->device, time_now())) {
+		    device_release(batch->device);
+		    for (i = 0; i < batch->count; i++)
+			process_result(worker, batch->targets[i], STAT_SKIPPED, NULL, NULL, 0);
+		    target_done(worker, batch, batch->count);
+		    continue;
+		}
+		if (!native_send(&n, batch))
+		    native_fallback(&n, batch);
+	    }
+	    native_flush(&n);
+
+	    /* Take in whatever has arrived before looking at timers; a
+	       batch passed to net-snmp may have kept us away a while */
+	    while (worker->inflight > 0 && native_drain(&n) > 0)
+		;
+	    expires = native_expire(&n, time_now());
+
+	    if (worker->inflight == 0) {
+		/* Every device we are holding work for is being paced */
+		if (ndeferred > 0 && (nap = wake - time_now()) > 0)
+		    usleep((unsigned int) (nap * 1000000));
+		continue;
+	    }
+
+	    /* Wait for responses, the next retransmit/timeout, or a paced
+	       device to come ready */
+	    if (ndeferred > 0 && wake < expires)
+		expires = wake;
+	    nap = expires - time_now();
+	    if (nap < 0)
+		nap = 0;
+	    timeout.tv_sec = (long) nap;
+	    timeout.tv_usec = (long) ((nap - timeout.tv_sec) * 1000000);
+	    /* A ring's descriptor is readable once it has completions */
+	    fd = n.uring ? n.uring->fd : n.sock;
+	    FD_ZERO(&fdset);
+	    FD_SET(fd, &fdset);
+	    waited = time_now();
+	    if (select(fd + 1, &fdset, NULL, NULL, &timeout) < 0 && errno != EINTR)
+		rtglog("*** Native select error: %s\n", strerror(errno));
+	    count_time(worker, PHASE_SNMP, waited);
+	}
+	/* Nothing is left waiting to be inserted while we are idle */
+	db_flush(worker, TRUE);
+
+    }				/* while(1) */
+
+    if (set.verbose >= HIGH)
+	rtglog("Thread [%d] retiring.\n", worker->index);
+    if (n.uring)
+	uring_close(n.uring);
+    close(n.sock);
+    free(n.req);
+    free(n.out);
+    free(n.outiov);
+    free(n.in);
+    if (MYSQL_VERSION_ID > 40000)
+       mysql_thread_end();
+    else
+       my_thread_end();
+    return NULL;
+}
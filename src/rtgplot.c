@@ -56,6 +56,8 @@
 
 /* dfp is a debug file pointer.  Points to stderr unless debug=level is set */
 FILE *dfp = NULL;
+/* rtgutil.c prints rtgpoll's statistics; rtgplot keeps none */
+stats_t stats;
 
 int main(int argc, char **argv) {
 	MYSQL           mysql;
@@ -315,6 +317,7 @@ int populate(char *query, MYSQL * mysql, data_t ** data, graph_t * graph) {
 		new->counter = strtol(row[0], NULL, 0);
 #endif
 		new->timestamp = atoi(row[1]);
+		new->secs = atof(row[1]);
 		new->next = NULL;
 		(range->datapoints)++;
 		if (new->counter > range->counter_max)
@@ -389,8 +392,8 @@ void calculate_rate(data_t ** data, rate_t * rate_stats, int factor) {
 	data_t         *entry = NULL;
 	float           rate = 0.0;
 	float           last_rate = 0.0;
-	int             sample_secs = 0;
-	int             last_sample_secs = 0;
+	double          sample_secs = 0;
+	double          last_sample_secs = 0;
 	int             num_rate_samples = 0;
 	int             i;
 
@@ -406,7 +409,7 @@ void calculate_rate(data_t ** data, rate_t * rate_stats, int factor) {
 
 	while (entry != NULL) {
 		rate_stats->total += entry->counter;
-		sample_secs = entry->timestamp;
+		sample_secs = entry->secs;
 		if (last_sample_secs != 0) {
 			num_rate_samples++;
 			rate = (float)entry->counter * factor / (sample_secs - last_sample_secs);
@@ -418,20 +421,20 @@ void calculate_rate(data_t ** data, rate_t * rate_stats, int factor) {
 			 */
 			if (sample_secs - last_sample_secs > set.highskewslop * set.interval) {
 				if (set.verbose >= LOW) {
-					fprintf(dfp, "***Poll skew [elapsed secs=%d] [interval = %d] [slop = %2.2f]\n",
+					fprintf(dfp, "***Poll skew [elapsed secs=%.3f] [interval = %d] [slop = %2.2f]\n",
 					       sample_secs - last_sample_secs, set.interval, set.highskewslop);
 				}
 				rate = last_rate;
 			}
 			if (sample_secs - last_sample_secs < set.lowskewslop * set.interval) {
 				if (set.verbose >= LOW) {
-					fprintf(dfp, "***Poll skew [elapsed secs=%d] [interval = %d] [slop = %2.2f]\n",
+					fprintf(dfp, "***Poll skew [elapsed secs=%.3f] [interval = %d] [slop = %2.2f]\n",
 					       sample_secs - last_sample_secs, set.interval, set.lowskewslop);
 				}
 				rate = last_rate;
 			}
 			if (set.verbose >= DEBUG)
-				fprintf(dfp, "  [row0=%lld][row1=%d][elapsed secs=%d][rate=%2.3f bps]\n", entry->counter, sample_secs, sample_secs - last_sample_secs, rate);
+				fprintf(dfp, "  [row0=%lld][row1=%.3f][elapsed secs=%.3f][rate=%2.3f bps]\n", entry->counter, sample_secs, sample_secs - last_sample_secs, rate);
 			if (rate < 0 && set.verbose >= LOW)
 				fprintf(dfp, "  ***Err: Negative rate!\n");
 			rate_stats->avg += rate;
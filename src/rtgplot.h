@@ -49,6 +49,7 @@
 typedef struct data_struct {
     long long counter;		// interval sample value
     unsigned long timestamp;	// UNIX timestamp
+    double secs;		// UNIX timestamp, with any fraction
     float rate;			// floating point rate
     int x;			// X plot coordinate
     int y;			// Y plot coordinate
@@ -8,14 +8,17 @@
 #define _REENTRANT
 #include "common.h"
 #include "rtg.h"
+#include <errno.h>
 
 /* Yes.  Globals. */
 stats_t stats =
-{PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, 0, 0.0};
+{PTHREAD_MUTEX_INITIALIZER, 0, 0, 0.0};
 char *target_file = NULL;
-target_t *current = NULL;
-MYSQL mysql;
+/* Held by main() while a round is running; target file reloads wait */
+pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
 int entries = 0;
+/* Threads to add (or remove, if negative) at the end of the round */
+int thread_adjust = 0;
 /* dfp is a debug file pointer.  Points to stderr unless debug=level is set */
 FILE *dfp = NULL;
 
@@ -25,11 +28,13 @@ int main(int argc, char *argv[]) {
     crew_t crew;
     pthread_t sig_thread;
     sigset_t signal_set;
+    pthread_condattr_t attr;
     struct timeval now;
-    double begin_time, end_time, sleep_time;
+    double begin_time, end_time, deadline;
+    unsigned int tick = 0;
     char *conf_file = NULL;
     char errstr[BUFSIZE];
-    int ch, i;
+    int ch, i, threads, adjust, pending, targets;
 
 	dfp = stderr;
 
@@ -77,6 +82,8 @@ int main(int argc, char *argv[]) {
     sigaddset(&signal_set, SIGTERM);
     sigaddset(&signal_set, SIGINT);
     sigaddset(&signal_set, SIGQUIT);
+    sigaddset(&signal_set, SIGTTIN);
+    sigaddset(&signal_set, SIGTTOU);
 	if (!set.multiple) 
     	checkPID(PIDFILE);
 
@@ -110,47 +117,59 @@ int main(int argc, char *argv[]) {
       }
     }
 
+    /* Initialize SNMP; the MIBs are needed to parse the target OIDs */
+    if (set.verbose >= LOW)
+	printf("Initializing SNMP (v%d, port %d, %s engine).\n", set.snmp_ver, set.snmp_port,
+	    set.engine == NATIVE ? "native" : set.engine == ASYNC ? "async" : "sync");
+    init_snmp("RTG");
+    init_sessions();
+
     /* hash list of targets to be polled */
 	entries = hash_target_file(target_file);
     if (entries <= 0) {
 	fprintf(stderr, "Error updating target list.");
 	exit(-1);
     }
-    if (set.verbose >= LOW)
-	printf("Initializing threads (%d).\n", set.threads);
+    if (set.verbose >= LOW) {
+	if (set.threads_max)
+	    printf("Initializing threads (%d, scaling %d-%d).\n", set.threads,
+		set.threads_min, set.threads_max);
+	else
+	    printf("Initializing threads (%d).\n", set.threads);
+    }
     pthread_mutex_init(&(crew.mutex), NULL);
-    pthread_cond_init(&(crew.done), NULL);
     pthread_cond_init(&(crew.go), NULL);
+    pthread_condattr_init(&attr);
+#ifdef HAVE_CLOCK_NANOSLEEP
+    /* Rounds are cut off at clock_now() times */
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&(crew.done), &attr);
     crew.work_count = 0;
+    crew.member = NULL;
+    crew.nthreads = 0;
+    crew.running = 0;
+    crew.busy = 0;
+    crew.generation = 0;
+    crew.closed = 0;
 
-    /* Initialize the SNMP session */
-    if (set.verbose >= LOW)
-	printf("Initializing SNMP (v%d, port %d).\n", set.snmp_ver, set.snmp_port);
-    init_snmp("RTG");
-
-    /* Attempt to connect to the MySQL Database */
+    /* Attempt to connect to the MySQL Database, a connection per writer */
     if (!(set.dboff)) {
-	if (rtg_dbconnect(set.dbdb, &mysql) < 0) {
+	if (set.verbose >= LOW)
+	    printf("Connecting %d writers to MySQL database '%s' on '%s'...\n",
+		set.db_writers, set.dbdb, set.dbhost);
+	if (!db_start()) {
 	    fprintf(stderr, "** Database error - check configuration.\n");
 	    exit(-1);
 	}
-	if (!mysql_ping(&mysql)) {
-	    if (set.verbose >= LOW)
-		printf("connected.\n");
-	} else {
-	    printf("server not responding.\n");
-	    exit(-1);
-	}
+	if (set.verbose >= LOW)
+	    printf("connected.\n");
     }
     if (set.verbose >= HIGH)
 	printf("\nStarting threads.\n");
 
-    for (i = 0; i < set.threads; i++) {
-	crew.member[i].index = i;
-	crew.member[i].crew = &crew;
-	if (pthread_create(&(crew.member[i].thread), NULL, poller, (void *) &(crew.member[i])) != 0)
-	    printf("pthread_create error\n");
-    }
+    log_init();
+    crew_resize(&crew, set.threads);
     if (pthread_create(&sig_thread, NULL, sig_handler, (void *) &(signal_set)) != 0)
 	printf("pthread_create error\n");
 
@@ -160,61 +179,112 @@ int main(int argc, char *argv[]) {
     if (set.verbose >= LOW)
 	printf("RTG Ready.\n");
 
-    /* Loop Forever Polling Target List */
+    PT_MUTEX_LOCK(&reload_mutex);
+    deadline = next_round(0, &tick);
+    PT_MUTEX_UNLOCK(&reload_mutex);
+    sleep_until(deadline);
+    PT_MUTEX_LOCK(&reload_mutex);
+
+    /* Loop Forever Polling Target List.  reload_mutex is only let go
+       while main() sleeps with nothing outstanding. */
     while (1) {
-	lock = TRUE;
+	/* A SIGHUP may have come in while a round's stragglers were out */
+	if ((pending = ATOMIC_ADD(&waiting, 0)) > 0) {
+	    round_end(&crew, TRUE, 0);
+	    if (set.verbose >= HIGH)
+		rtglog("Processing pending SIGHUP.\n");
+	    ATOMIC_ADD(&waiting, -pending);
+	    entries = hash_target_file(target_file);
+	}
 	gettimeofday(&now, NULL);
 	begin_time = (double) now.tv_usec / 1000000 + now.tv_sec;
 
-	PT_MUTEX_LOCK(&(crew.mutex));
-	init_hash_walk();
-	current = getNext();
-	crew.work_count = entries;
-	PT_MUTEX_UNLOCK(&(crew.mutex));
+	/* Batches are due from when the round should have started */
+	targets = init_hash_walk(begin_time - (clock_now() - deadline));
+
+	/* No class has a wheel slot due this round */
+	if (targets == 0) {
+	    deadline = next_round(deadline, &tick);
+	    if (round_end(&crew, TRUE, deadline)) {
+		PT_MUTEX_UNLOCK(&reload_mutex);
+		sleep_until(deadline);
+		PT_MUTEX_LOCK(&reload_mutex);
+	    }
+	    continue;
+	}
 	    
+	/* What the last round logged goes out before the timestamp */
+	log_flush();
 	if (set.verbose >= LOW)
-        timestamp("Queue ready, broadcasting thread go condition.");
-	PT_COND_BROAD(&(crew.go));
-	PT_MUTEX_LOCK(&(crew.mutex));
-	    
-	while (crew.work_count > 0) {
-		PT_COND_WAIT(&(crew.done), &(crew.mutex));
+        timestamp("Queue ready, releasing threads.");
+	/* Start the round and give it until the next one is due;
+	   stragglers from the last may still be claiming */
+	PT_MUTEX_LOCK(&stats.mutex);
+	stats.late = 0;
+	PT_MUTEX_UNLOCK(&stats.mutex);
+	round_start(&crew, targets);
+	if (!round_end(&crew, FALSE, deadline + tick)) {
+	    stats.slow++;
+	    if (set.verbose >= LOW)
+		rtglog("*** Poll round cut off with %d targets outstanding.\n", ATOMIC_ADD(&crew.work_count, 0));
 	}
-	PT_MUTEX_UNLOCK(&(crew.mutex));
+	round_close(&crew);
 
 	gettimeofday(&now, NULL);
-	lock = FALSE;
 	end_time = (double) now.tv_usec / 1000000 + now.tv_sec;
 	stats.poll_time = end_time - begin_time;
+	stats.total_time += stats.poll_time;
         stats.round++;
-	sleep_time = set.interval - stats.poll_time;
 
-	if (waiting) {
+	if ((pending = ATOMIC_ADD(&waiting, 0)) > 0) {
+	    round_end(&crew, TRUE, 0);
 	    if (set.verbose >= HIGH)
-		printf("Processing pending SIGHUP.\n");
+		rtglog("Processing pending SIGHUP.\n");
+	    ATOMIC_ADD(&waiting, -pending);
 	    entries = hash_target_file(target_file);
-	    waiting = FALSE;
 	}
+	log_flush();
 	if (set.verbose >= LOW) {
         snprintf(errstr, sizeof(errstr), "Poll round %d complete.", stats.round);
         timestamp(errstr);
+	    db_stats();
 	    print_stats(stats);
     }
-	if (sleep_time <= 0)
-	    stats.slow++;
-	else
-	    sleepy(sleep_time);
+
+	/* Resize the crew for the next round */
+	threads = crew.nthreads;
+	if (set.threads_max && set.engine == SYNC)
+	    threads = scale_threads(threads, stats.poll_time);
+	adjust = ATOMIC_ADD(&thread_adjust, 0);
+	ATOMIC_ADD(&thread_adjust, -adjust);
+	threads += adjust;
+	if (set.threads_max) {
+	    if (threads < set.threads_min) threads = set.threads_min;
+	    if (threads > set.threads_max) threads = set.threads_max;
+	}
+	if (threads < 1)
+	    threads = 1;
+	if (threads != crew.nthreads) {
+	    if (set.verbose >= LOW)
+		rtglog("Resizing from %d to %d threads.\n", crew.nthreads, threads);
+	    crew_resize(&crew, threads);
+	}
+
+	/* Stragglers may still be out; a reload waits until they are in */
+	deadline = next_round(deadline, &tick);
+	if (round_end(&crew, TRUE, deadline)) {
+	    PT_MUTEX_UNLOCK(&reload_mutex);
+	    sleep_until(deadline);
+	    PT_MUTEX_LOCK(&reload_mutex);
+	}
     } /* while */
 
-    /* Disconnect from the MySQL Database, exit. */
-    if (!(set.dboff))
-	rtg_dbdisconnect(&mysql);
     exit(0);
 }
 
 
 /* Signal Handler.  USR1 increases verbosity, USR2 decreases verbosity. 
-   HUP re-reads target list */
+   HUP re-reads target list.  TTIN adds a thread, TTOU removes one. */
 void *sig_handler(void *arg)
 {
     sigset_t *signal_set = (sigset_t *) arg;
@@ -224,12 +294,12 @@ void *sig_handler(void *arg)
 	sigwait(signal_set, &sig_number);
 	switch (sig_number) {
             case SIGHUP:
-                if(lock) {
-                    waiting = TRUE;
-                }
-                else {
+                /* Reload now unless a round is running */
+                if (pthread_mutex_trylock(&reload_mutex) == 0) {
                     entries = hash_target_file(target_file);
-                    waiting = FALSE;
+                    PT_MUTEX_UNLOCK(&reload_mutex);
+                } else {
+                    ATOMIC_ADD(&waiting, 1);
                 }
                 break;
             case SIGUSR1:
@@ -238,12 +308,18 @@ void *sig_handler(void *arg)
             case SIGUSR2:
                 set.verbose--;
                 break;
+            case SIGTTIN:
+                ATOMIC_ADD(&thread_adjust, 1);
+                break;
+            case SIGTTOU:
+                ATOMIC_ADD(&thread_adjust, -1);
+                break;
             case SIGTERM:
             case SIGINT:
             case SIGQUIT:
                 if (set.verbose >= LOW)
-                   printf("Quiting: received signal %d.\n", sig_number);
-                rtg_dbdisconnect(&mysql);
+                   rtglog("Quiting: received signal %d.\n", sig_number);
+                log_flush();
                 unlink(PIDFILE);
                 exit(1);
                 break;
@@ -252,6 +328,188 @@ void *sig_handler(void *arg)
 }
 
 
+/* Go idle until a round after the one worker last took part in starts,
+   and join it.  Returns FALSE if the worker has been retired instead. */
+int round_wait(worker_t *worker)
+{
+    crew_t *crew = worker->crew;
+    double idle = time_now();
+    int stay;
+
+    PT_MUTEX_LOCK(&crew->mutex);
+    /* main() may be waiting for the last straggler */
+    if (--(crew->busy) == 0)
+	PT_COND_BROAD(&crew->done);
+    while (worker->round == crew->generation) {
+	PT_COND_WAIT(&crew->go, &crew->mutex);
+    }
+    worker->round = crew->generation;
+    if ((stay = worker->index < crew->nthreads))
+	crew->busy++;
+    PT_MUTEX_UNLOCK(&crew->mutex);
+    count_time(worker, PHASE_IDLE, idle);
+    return stay;
+}
+
+
+/* Join the next round, if it has started, without going idle: answers
+   owed from the last one can come in while the new one is polled.
+   Returns TRUE if it had. */
+int round_started(worker_t *worker)
+{
+    crew_t *crew = worker->crew;
+    int started = FALSE;
+
+    PT_MUTEX_LOCK(&crew->mutex);
+    if (worker->round != crew->generation && worker->index < crew->nthreads) {
+	worker->round = crew->generation;
+	started = TRUE;
+    }
+    PT_MUTEX_UNLOCK(&crew->mutex);
+    return started;
+}
+
+
+/* Start a round of targets targets, waking the idle workers */
+void round_start(crew_t *crew, int targets)
+{
+    ATOMIC_ADD(&crew->work_count, targets);
+    PT_MUTEX_LOCK(&crew->mutex);
+    crew->generation++;
+    open_hash_walk(crew->generation);
+    PT_COND_BROAD(&crew->go);
+    PT_MUTEX_UNLOCK(&crew->mutex);
+}
+
+
+/* Wait until the crew has no work left and, if idle, every worker has
+   gone idle too, or until cutoff by clock_now() if that comes first (0
+   for no cutoff).  Returns TRUE if it got there. */
+int round_end(crew_t *crew, int idle, double cutoff)
+{
+    struct timespec ts;
+    int over = TRUE;
+
+    ts.tv_sec = (time_t) cutoff;
+    ts.tv_nsec = (long) ((cutoff - ts.tv_sec) * 1000000000);
+    PT_MUTEX_LOCK(&crew->mutex);
+    while (ATOMIC_ADD(&crew->work_count, 0) > 0 || (idle && crew->busy > 0)) {
+	if (cutoff == 0) {
+	    PT_COND_WAIT(&crew->done, &crew->mutex);
+	} else if (pthread_cond_timedwait(&crew->done, &crew->mutex, &ts) == ETIMEDOUT) {
+	    over = FALSE;
+	    break;
+	}
+    }
+    PT_MUTEX_UNLOCK(&crew->mutex);
+    return over;
+}
+
+
+/* Cut off the running round: nothing more of it is claimed and the
+   targets nobody claimed are abandoned.  Work under way is left to
+   finish; workers give up what they had put off when they see it. */
+void round_close(crew_t *crew)
+{
+    int abandoned;
+
+    abandoned = close_hash_walk();
+    /* Rounds are closed in the order they start */
+    ATOMIC_ADD(&crew->closed, 1);
+    if (abandoned > 0) {
+	stats.abandoned += abandoned;
+	work_done(crew, abandoned);
+    }
+}
+
+
+/* Grow or shrink the crew to threads workers.  Only called by main()
+   between rounds; stragglers from the last one may still be busy. */
+void crew_resize(crew_t *crew, int threads)
+{
+    worker_t **member = NULL;
+    int i;
+
+    /* Reap the workers retired last time; they left when this round
+       started, or will once done with the last */
+    for (i = crew->nthreads; i < crew->running; i++) {
+	pthread_join(crew->member[i]->thread, NULL);
+	free(crew->member[i]);
+    }
+    crew->running = crew->nthreads;
+
+    if (threads < crew->nthreads) {
+	PT_MUTEX_LOCK(&crew->mutex);
+	crew->nthreads = threads;
+	PT_MUTEX_UNLOCK(&crew->mutex);
+	return;
+    }
+
+    member = (worker_t **) realloc(crew->member, threads * sizeof(worker_t *));
+    if (!member) {
+	printf("Fatal thread malloc error!\n");
+	exit(-1);
+    }
+    crew->member = member;
+    /* Count the new workers busy until they first go idle */
+    PT_MUTEX_LOCK(&crew->mutex);
+    crew->busy += threads - crew->running;
+    crew->nthreads = threads;
+    PT_MUTEX_UNLOCK(&crew->mutex);
+    for (i = crew->running; i < threads; i++) {
+	crew->member[i] = (worker_t *) malloc(sizeof(worker_t));
+	if (!crew->member[i]) {
+	    printf("Fatal thread malloc error!\n");
+	    exit(-1);
+	}
+	crew->member[i]->index = i;
+	crew->member[i]->crew = crew;
+	crew->member[i]->counters = counters_get(i);
+	crew->member[i]->log = log_ring(i);
+	crew->member[i]->dbbufs = NULL;
+	crew->member[i]->db_since = 0;
+	crew->member[i]->inflight = 0;
+	crew->member[i]->round = crew->generation;
+	if (pthread_create(&(crew->member[i]->thread), NULL,
+	    set.engine == NATIVE ? native_poller : set.engine == ASYNC ? async_poller : poller,
+	    (void *) crew->member[i]) != 0) {
+	    printf("pthread_create error\n");
+	    exit(-1);
+	}
+    }
+    crew->running = threads;
+}
+
+
+/* When the round after the one due at deadline starts.  Rounds start
+   on multiples of the round length by the time of day, each one tick
+   after the last, so they do not drift however long each takes; a
+   reload that changes the tick realigns them.  A round is cut off when
+   the next is due, so that one starts at most a little late; rounds
+   that could not start before the one after them was due (main() was
+   held up, by a reload say) are skipped, keeping the spacing between
+   polls a whole number of ticks.  Called with reload_mutex held. */
+double next_round(double deadline, unsigned int *tick)
+{
+    double now = clock_now();
+    int skipped;
+
+    if (hash.tick != *tick) {
+	*tick = hash.tick;
+	return next_boundary(*tick);
+    }
+    deadline += *tick;
+    if (deadline + *tick <= now) {
+	skipped = (int) ((now - deadline) / *tick);
+	deadline += skipped * *tick;
+	stats.slow++;
+	if (set.verbose >= LOW)
+	    rtglog("*** Poll rounds held up, skipping %d round%s.\n", skipped, skipped > 1 ? "s" : "");
+    }
+    return deadline;
+}
+
+
 void usage(char *prog)
 {
     printf("rtgpoll - RTG v%s\n", VERSION);
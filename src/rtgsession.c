@@ -0,0 +1,269 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG SNMP session cache
+****************************************************************************/
+
+#include "common.h"
+#include "rtg.h"
+#include <sys/resource.h>
+
+/* Open SNMP sessions are cached across poll rounds, keyed by host,
+   community, port and version.  Each key keeps a stack of idle sessions;
+   a thread checks one out for the duration of a request and puts it
+   back afterwards.  No more than sessions_max are ever open: at the
+   limit the least recently used idle session, of any key, is closed to
+   make room, and if none is idle no session is opened. */
+pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+session_t *session_table[HASHSIZE];
+session_t *session_newest = NULL;
+session_t *session_oldest = NULL;
+int sessions_open = 0;
+int sessions_max = 0;
+
+
+/* Work out how many sessions we may keep open */
+void init_sessions() {
+	struct rlimit rl;
+
+	sessions_max = set.sessions;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+		if (sessions_max == 0 || sessions_max > (int) rl.rlim_cur - SESSION_FD_RESERVE)
+			sessions_max = (int) rl.rlim_cur - SESSION_FD_RESERVE;
+	}
+	/* The async engine select()s on its sessions */
+	if (set.engine == ASYNC && (sessions_max == 0 ||
+	    sessions_max > FD_SETSIZE - ASYNC_FD_RESERVE))
+		sessions_max = FD_SETSIZE - ASYNC_FD_RESERVE;
+	if (sessions_max < 1)
+		sessions_max = 1;
+	if (set.verbose >= LOW)
+		printf("Caching up to %d SNMP sessions.\n", sessions_max);
+}
+
+
+unsigned long session_key(const char *host, const char *community,
+			  unsigned short port, unsigned short version) {
+	return ((device_key(host, community) + 31 * port + version) % HASHSIZE);
+}
+
+
+/* return ptr to the cache entry for device's current parameters */
+session_t *find_session(device_t *d) {
+	session_t *s = NULL;
+
+	s = session_table[session_key(d->host, d->community, d->port, d->version)];
+	for (; s; s = s->next) {
+		if (!strcmp(s->host, d->host) && !strcmp(s->community, d->community) &&
+		    s->port == d->port && s->version == d->version)
+			return s;
+	}
+	return NULL;
+}
+
+
+/* Open a new net-snmp session for a cache entry */
+void *session_open(session_t *s) {
+	struct snmp_session session;
+
+	snmp_sess_init(&session);
+	if (s->version == 2)
+		session.version = SNMP_VERSION_2c;
+	else
+		session.version = SNMP_VERSION_1;
+	session.peername = s->host;
+	session.remote_port = s->port;
+	session.community = (u_char *) s->community;
+	session.community_len = strlen(s->community);
+	return snmp_sess_open(&session);
+}
+
+
+/* Check out a session to device.  Returns NULL if none could be opened;
+   otherwise *entry must later be handed to session_put() with it. */
+void *session_get(device_t *d, session_t **entry) {
+	session_t *s = NULL;
+	void *sessp = NULL;
+	unsigned long key;
+
+	PT_MUTEX_LOCK(&session_mutex);
+	if (!(s = d->session)) {
+		if (!(s = find_session(d))) {
+			s = (session_t *) malloc(sizeof(session_t));
+			if (!s) {
+				printf("Fatal session malloc error!\n");
+				exit(-1);
+			}
+			memset(s, 0, sizeof(session_t));
+			strncpy(s->host, d->host, sizeof(s->host));
+			strncpy(s->community, d->community, sizeof(s->community));
+			s->port = d->port;
+			s->version = d->version;
+			s->live = TRUE;
+			key = session_key(s->host, s->community, s->port, s->version);
+			s->next = session_table[key];
+			session_table[key] = s;
+		}
+		d->session = s;
+	}
+	if (s->nidle > 0) {
+		sessp = s->idle[--(s->nidle)];
+		if (s->nidle == 0)
+			session_unused(s);
+	} else {
+		while (sessions_open >= sessions_max && session_evict())
+			;
+		if (sessions_open >= sessions_max) {
+			PT_MUTEX_UNLOCK(&session_mutex);
+			return NULL;
+		}
+		sessions_open++;
+	}
+	s->busy++;
+	PT_MUTEX_UNLOCK(&session_mutex);
+
+	/* Resolving the peer can be slow; do it outside the lock */
+	if (!sessp && !(sessp = session_open(s))) {
+		session_put(s, NULL);
+		return NULL;
+	}
+	*entry = s;
+	return sessp;
+}
+
+
+/* Return a session to the cache.  It is closed instead if the cache is
+   full or a reload dropped its key. */
+void session_put(session_t *s, void *sessp) {
+	void **idle = NULL;
+
+	PT_MUTEX_LOCK(&session_mutex);
+	s->busy--;
+	if (sessp && s->live && sessions_open <= sessions_max) {
+		if (s->nidle == s->maxidle) {
+			idle = (void **) realloc(s->idle, (s->maxidle + 4) * sizeof(void *));
+			if (!idle) {
+				printf("Fatal session malloc error!\n");
+				exit(-1);
+			}
+			s->idle = idle;
+			s->maxidle += 4;
+		}
+		s->idle[(s->nidle)++] = sessp;
+		session_used(s);
+		sessp = NULL;
+	} else {
+		sessions_open--;
+	}
+	if (!s->live && s->busy == 0 && s->nidle == 0) {
+		free(s->idle);
+		free(s);
+	}
+	PT_MUTEX_UNLOCK(&session_mutex);
+
+	if (sessp)
+		snmp_sess_close(sessp);
+}
+
+
+/* Put s, which has idle sessions, first on the recently used list.
+   Called with session_mutex held. */
+void session_used(session_t *s) {
+	if (s == session_newest)
+		return;
+	if (s->newer)
+		session_unused(s);
+	s->newer = NULL;
+	s->older = session_newest;
+	if (session_newest)
+		session_newest->newer = s;
+	session_newest = s;
+	if (!session_oldest)
+		session_oldest = s;
+}
+
+
+/* Take s, which has no idle sessions left, off the recently used list.
+   Called with session_mutex held. */
+void session_unused(session_t *s) {
+	if (s->newer)
+		s->newer->older = s->older;
+	else
+		session_newest = s->older;
+	if (s->older)
+		s->older->newer = s->newer;
+	else
+		session_oldest = s->newer;
+	s->newer = s->older = NULL;
+}
+
+
+/* Close the oldest idle session of the least recently used entry.
+   Returns FALSE if there was none.  Called with session_mutex held. */
+int session_evict() {
+	session_t *s = session_oldest;
+
+	if (!s)
+		return FALSE;
+	snmp_sess_close(s->idle[0]);
+	memmove(s->idle, s->idle + 1, --(s->nidle) * sizeof(void *));
+	sessions_open--;
+	if (s->nidle == 0)
+		session_unused(s);
+	return TRUE;
+}
+
+
+/* After a target file reload, point each device at the cache entry for
+   its (possibly changed) parameters and close the sessions of entries
+   no device uses any more.  Entries with sessions still checked out are
+   freed by the last session_put(). */
+void session_sweep() {
+	session_t *s = NULL;
+	session_t *prev = NULL;
+	session_t *next = NULL;
+	device_t *d = NULL;
+	int closed = 0;
+	int i;
+
+	PT_MUTEX_LOCK(&session_mutex);
+	for (i=0;i<HASHSIZE;i++) {
+		for (s = session_table[i]; s; s = s->next)
+			s->live = FALSE;
+	}
+	for (i=0;i<HASHSIZE;i++) {
+		for (d = hash.devices[i]; d; d = d->next) {
+			if ((d->session = find_session(d)))
+				d->session->live = TRUE;
+		}
+	}
+	for (i=0;i<HASHSIZE;i++) {
+		prev = NULL;
+		for (s = session_table[i]; s; s = next) {
+			next = s->next;
+			if (s->live) {
+				prev = s;
+				continue;
+			}
+			if (prev)
+				prev->next = next;
+			else
+				session_table[i] = next;
+			if (s->nidle > 0)
+				session_unused(s);
+			while (s->nidle > 0) {
+				snmp_sess_close(s->idle[--(s->nidle)]);
+				sessions_open--;
+				closed++;
+			}
+			if (s->busy == 0) {
+				free(s->idle);
+				free(s);
+			}
+		}
+	}
+	PT_MUTEX_UNLOCK(&session_mutex);
+	if (set.verbose >= LOW && closed > 0)
+		printf("Closed [%d] SNMP sessions to changed or removed devices.\n", closed);
+}
@@ -8,245 +8,490 @@
 #include "common.h"
 #include "rtg.h"
 
-#ifdef OLD_UCD_SNMP
- #include "asn1.h"
- #include "snmp_api.h"
- #include "snmp_impl.h"
- #include "snmp_client.h"
- #include "mib.h"
- #include "snmp.h"
-#else
- #include "net-snmp-config.h"
- #include "net-snmp-includes.h"
-#endif
-
-extern target_t *current;
-extern stats_t stats;
-extern MYSQL mysql;
 
 void *poller(void *thread_args)
 {
     worker_t *worker = (worker_t *) thread_args;
     crew_t *crew = worker->crew;
-    target_t *entry = NULL;
-    void *sessp = NULL;
-    struct snmp_session session;
-    struct snmp_pdu *pdu = NULL;
-    struct snmp_pdu *response = NULL;
-    oid anOID[MAX_OID_LEN];
-    size_t anOID_len = MAX_OID_LEN;
-    struct variable_list *vars = NULL;
-    unsigned long long result = 0;
-    unsigned long long last_value = 0;
-    unsigned long long insert_val = 0;
-    int status = 0, bits = 0, init = 0;
-    char query[BUFSIZE];
-    char storedoid[BUFSIZE];
-    char result_string[BUFSIZE];
+    batch_t *batch = NULL;
+    batch_t *deferred[MAX_DEFERRED];
+    double wake, nap;
+    int ndeferred, more;
 
+    log_attach(worker->log);
     if (set.verbose >= HIGH)
-	printf("Thread [%d] starting.\n", worker->index);
+	rtglog("Thread [%d] starting.\n", worker->index);
     if (MYSQL_VERSION_ID > 40000)
        mysql_thread_init();
-    else 
+    else
        my_thread_init();
 
     while (1) {
 	if (set.verbose >= DEVELOP)
-	    printf("Thread [%d] locking (wait on work)\n", worker->index);
+	    rtglog("Thread [%d] waiting on round start\n", worker->index);
+	if (!round_wait(worker))
+	    break;
+	if (set.verbose >= DEVELOP)
+	    rtglog("Thread [%d] received go (work cnt: %d)\n", worker->index, crew->work_count);
+
+	more = TRUE;
+	ndeferred = 0;
+	while (more || ndeferred > 0) {
+	    if ((batch = claim_batch(worker, deferred, &ndeferred, &more, &wake)) == NULL) {
+		/* Every device we are holding work for is being paced */
+		if (ndeferred > 0 && (nap = wake - time_now()) > 0)
+		    usleep((unsigned int) (nap * 1000000));
+		continue;
+	    }
+	    if (set.verbose >= HIGH)
+	      rtglog("Thread [%d] processing %s (%d OIDs) (%d work units remain in queue)\n", worker->index, batch->device->host, batch->count, ATOMIC_ADD(&crew->work_count, 0));
+	    poll_sync(worker, batch);
+	    db_flush(worker, FALSE);
+	}
+	/* Nothing is left waiting to be inserted while we are idle */
+	db_flush(worker, TRUE);
+
+    }				/* while(1) */
+
+    if (set.verbose >= HIGH)
+	rtglog("Thread [%d] retiring.\n", worker->index);
+    if (MYSQL_VERSION_ID > 40000)
+       mysql_thread_end();
+    else
+       my_thread_end();
+    return NULL;
+}
+
+
+/* Poll a claimed batch with blocking requests through a checked out
+   session, then release its device and account for its targets */
+void poll_sync(worker_t *worker, batch_t *batch)
+{
+    session_t *entry = NULL;
+    void *sessp = NULL;
+    int i;
+
+    if (!device_up(batch->device, time_now())) {
+	for (i = 0; i < batch->count; i++)
+	    process_result(worker, batch->targets[i], STAT_SKIPPED, NULL, NULL, 0);
+    } else if ((sessp = session_get(batch->device, &entry)) != NULL) {
+	poll_batch(worker, sessp, batch->targets, batch->count, batch->bulk);
+	session_put(entry, sessp);
+    } else {
+	for (i = 0; i < batch->count; i++)
+	    process_result(worker, batch->targets[i], STAT_DESCRIP_ERROR, NULL, NULL, 0);
+    }
+    device_release(batch->device);
+    target_done(worker, batch, batch->count);
+}
 
-	PT_MUTEX_LOCK(&crew->mutex);
 
-	while (current == NULL) {
-		PT_COND_WAIT(&crew->go, &crew->mutex);
+/* Resolve a target's OID to binary form once, at load time, and for
+   the native engine to BER as well.  Returns FALSE if it does not
+   parse. */
+int target_oid(target_t *entry)
+{
+    oid anOID[MAX_OID_LEN];
+    size_t anOID_len = MAX_OID_LEN;
+    u_char ber[BER_OID_MAX];
+
+    if (!read_objid(entry->objoid, anOID, &anOID_len))
+	return FALSE;
+    entry->anOID = (oid *) malloc(anOID_len * sizeof(oid));
+    if (!entry->anOID) {
+	printf("Fatal OID malloc error!\n");
+	exit(-1);
+    }
+    memcpy(entry->anOID, anOID, anOID_len * sizeof(oid));
+    entry->anOID_len = anOID_len;
+
+    /* An OID that cannot be encoded is left to net-snmp */
+    entry->ber = NULL;
+    entry->ber_len = 0;
+    if (set.engine == NATIVE &&
+        (entry->ber_len = ber_oid(ber, sizeof(ber), anOID, anOID_len)) > 0) {
+	entry->ber = (u_char *) malloc(entry->ber_len);
+	if (!entry->ber) {
+	    printf("Fatal OID malloc error!\n");
+	    exit(-1);
 	}
-	if (set.verbose >= DEVELOP)
-	    printf("Thread [%d] done waiting, received go (work cnt: %d)\n", worker->index, crew->work_count);
+	memcpy(entry->ber, ber + sizeof(ber) - entry->ber_len, entry->ber_len);
+    }
+    return TRUE;
+}
+
+
+/* Synchronously GET count targets from one device in a single PDU,
+   splitting and retrying if the agent refuses part of the request.  A
+   walk (bulk > 0) is continued until its last target is reached. */
+void poll_batch(worker_t *worker, void *sessp, target_t **targets, int count, int bulk)
+{
+    struct snmp_pdu *pdu = NULL;
+    struct snmp_pdu *response = NULL;
+    target_t *retry[MAX_OIDS];
+    double sent, received;
+    int status, outcome, i, n;
+
+    pdu = batch_pdu(targets, count, bulk);
+    device_timeout(targets[0]->device, sessp);
+    sent = time_now();
+    status = snmp_sess_synch_response(sessp, pdu, &response);
+    received = time_now();
+    count_time(worker, PHASE_SNMP, sent);
+    device_result(targets[0]->device, status, sent);
+    outcome = process_batch(worker, targets, count, bulk, status, response, received);
+    if (response != NULL)
+	snmp_free_pdu(response);
+
+    if (outcome == BATCH_SPLIT) {
+	COUNT(worker->counters->retries, 2);
+	poll_batch(worker, sessp, targets, count / 2, bulk);
+	poll_batch(worker, sessp, targets + count / 2, count - count / 2, bulk);
+    } else if (bulk && outcome > 0) {
+	poll_batch(worker, sessp, targets + outcome, count - outcome, bulk);
+    } else if (outcome >= 0) {
+	for (i = 0, n = 0; i < count; i++) {
+	    if (i != outcome)
+		retry[n++] = targets[i];
+	}
+	COUNT(worker->counters->retries, 1);
+	poll_batch(worker, sessp, retry, n, bulk);
+    }
+}
+
+
+/* Account for count of batch's targets finished by worker.  Those
+   that finish after their round was cut off are stragglers. */
+void target_done(worker_t *worker, batch_t *batch, int count)
+{
+	if (ATOMIC_ADD(&worker->crew->closed, 0) >= batch->round)
+	    COUNT(worker->counters->stragglers, count);
+	ATOMIC_ADD(&(batch->pending), -count);
+	work_done(worker->crew, count);
+}
+
 
-	if (current != NULL) {
+/* Give up on a claimed batch that was not sent: its round was cut off
+   first, or its targets are still pending from an earlier round */
+void target_abandon(worker_t *worker, batch_t *batch)
+{
+	COUNT(worker->counters->abandoned, batch->count);
+	ATOMIC_ADD(&(batch->pending), -batch->count);
+	work_done(worker->crew, batch->count);
+}
+
+
+/* Take count targets off the crew's work, telling main() once it has
+   none left */
+void work_done(crew_t *crew, int count)
+{
+	if (ATOMIC_ADD(&crew->work_count, -count) == count) {
 	    if (set.verbose >= HIGH)
-	      printf("Thread [%d] processing %s %s (%d work units remain in queue)\n", worker->index, current->host, current->objoid, crew->work_count);
-	    snmp_sess_init(&session);
-		if (set.snmp_ver == 2)
-	      session.version = SNMP_VERSION_2c;
-		else
-	      session.version = SNMP_VERSION_1;
-	    session.peername = current->host;
-		session.remote_port = set.snmp_port;
-	    session.community = current->community;
-	    session.community_len = strlen(session.community);
-
-	    sessp = snmp_sess_open(&session);
-	    anOID_len = MAX_OID_LEN;
-	    pdu = snmp_pdu_create(SNMP_MSG_GET);
-	    read_objid(current->objoid, anOID, &anOID_len);
-	    entry = current;
-	    last_value = current->last_value;
-	    init = current->init;
-	    insert_val = 0;
-	    bits = current->bits;
-	    strncpy(storedoid, current->objoid, sizeof(storedoid));
-		current = getNext();
+		rtglog("Queue processed.\n");
+	    PT_MUTEX_LOCK(&crew->mutex);
+	    PT_COND_BROAD(&crew->done);
+	    PT_MUTEX_UNLOCK(&crew->mutex);
 	}
-	if (set.verbose >= DEVELOP)
-	    printf("Thread [%d] unlocking (done grabbing current)\n", worker->index);
-	PT_MUTEX_UNLOCK(&crew->mutex);
-	snmp_add_null_var(pdu, anOID, anOID_len);
-	if (sessp != NULL) 
-	   status = snmp_sess_synch_response(sessp, pdu, &response);
+}
+
+
+/* Build a GET request with one varbind per target, or for a walk a
+   GETBULK starting just before the first target's row */
+struct snmp_pdu *batch_pdu(target_t **targets, int count, int bulk)
+{
+    struct snmp_pdu *pdu = NULL;
+    oid anOID[MAX_OID_LEN];
+    size_t anOID_len;
+    int i;
+
+    if (bulk) {
+	pdu = snmp_pdu_create(SNMP_MSG_GETBULK);
+	pdu->non_repeaters = 0;
+	pdu->max_repetitions = count < bulk ? count : bulk;
+	anOID_len = targets[0]->anOID_len;
+	memcpy(anOID, targets[0]->anOID, anOID_len * sizeof(oid));
+	if (anOID[anOID_len - 1] > 0)
+	    anOID[anOID_len - 1]--;
 	else
-	   status = STAT_DESCRIP_ERROR;
+	    anOID_len--;
+	snmp_add_null_var(pdu, anOID, anOID_len);
+	return pdu;
+    }
+
+    pdu = snmp_pdu_create(SNMP_MSG_GET);
+    for (i = 0; i < count; i++)
+	snmp_add_null_var(pdu, targets[i]->anOID, targets[i]->anOID_len);
+    return pdu;
+}
+
+
+/* Hand each varbind of a multi-varbind response to its target.  If the
+   agent rejected the request as a whole (tooBig, or an error it could
+   not pin on one varbind) nothing is processed and BATCH_SPLIT is
+   returned; if it named one bad varbind that target is failed and its
+   index returned so the caller can retry the rest.  Otherwise every
+   target has been processed and BATCH_DONE is returned.  Walks are
+   handled by process_walk(). */
+int process_batch(worker_t *worker, target_t **targets, int count, int bulk, int status, struct snmp_pdu *response, double received)
+{
+    struct variable_list *vars = NULL;
+    int i;
+
+    if (bulk)
+	return process_walk(worker, targets, count, status, response, received);
+
+    if (status == STAT_SUCCESS && response->errstat != SNMP_ERR_NOERROR && count > 1) {
+	i = response->errindex - 1;
+	if (response->errstat != SNMP_ERR_TOOBIG && i >= 0 && i < count) {
+	    process_result(worker, targets[i], status, response, NULL, received);
+	    return i;
+	}
+	if (set.verbose >= HIGH)
+	    rtglog("*** SNMP %s from %s, splitting %d OIDs.\n",
+		snmp_errstring(response->errstat), targets[0]->host, count);
+	return BATCH_SPLIT;
+    }
+
+    if (status == STAT_SUCCESS)
+	vars = response->variables;
+    for (i = 0; i < count; i++) {
+	process_result(worker, targets[i], status, response, vars, received);
+	if (vars)
+	    vars = vars->next_variable;
+    }
+    return BATCH_DONE;
+}
+
+
+/* Hand the rows of a GETBULK column walk to targets, which are sorted
+   by instance; every target on a row gets it, as the same instance may
+   be polled into more than one table, and a target whose row the
+   agent skipped over is failed.
+   Returns the number of targets processed if the response ran out
+   before the last target's row, BATCH_SPLIT on tooBig, otherwise
+   BATCH_DONE. */
+int process_walk(worker_t *worker, target_t **targets, int count, int status, struct snmp_pdu *response, double received)
+{
+    struct variable_list *vars = NULL;
+    oid *column = targets[0]->anOID;
+    size_t column_len = targets[0]->collen;
+    int i = 0;
+
+    if (status == STAT_SUCCESS && response->errstat == SNMP_ERR_TOOBIG && count > 1) {
+	if (set.verbose >= HIGH)
+	    rtglog("*** SNMP %s from %s, splitting %d row walk.\n",
+		snmp_errstring(response->errstat), targets[0]->host, count);
+	return BATCH_SPLIT;
+    }
+
+    if (status == STAT_SUCCESS && response->errstat == SNMP_ERR_NOERROR) {
+	for (vars = response->variables; vars && i < count; vars = vars->next_variable) {
+	    /* Walked off the end of the column */
+	    if (vars->type == SNMP_ENDOFMIBVIEW || vars->name_length != column_len + 1 ||
+		snmp_oid_compare(vars->name, column_len, column, column_len) != 0)
+		break;
+	    while (i < count && targets[i]->instance < vars->name[column_len])
+		process_result(worker, targets[i++], status, response, NULL, received);
+	    while (i < count && targets[i]->instance == vars->name[column_len])
+		process_result(worker, targets[i++], status, response, vars, received);
+	}
+	/* Out of repetitions, still inside the column */
+	if (vars == NULL && i > 0 && i < count)
+	    return i;
+    }
+
+    for (; i < count; i++)
+	process_result(worker, targets[i], status, response, NULL, received);
+    return BATCH_DONE;
+}
+
+
+/* Pull the value out of a response varbind.  Returns FALSE for types
+   we do not know how to turn into a counter. */
+int snmp_value(target_t *entry, struct variable_list *vars, unsigned long long *result)
+{
+    char result_string[BUFSIZE];
+
+    if (set.verbose >= DEBUG) {
+#ifdef OLD_UCD_SNMP
+        sprint_value(result_string, vars->name, vars->name_length, vars);
+#else
+	snprint_value(result_string, BUFSIZE, vars->name, vars->name_length, vars);
+#endif
+    }
+    switch (vars->type) {
+	/*
+	 * Switch over vars->type and modify/assign result accordingly.
+	 */
+	case ASN_COUNTER64:
+	    if (set.verbose >= DEBUG) rtglog("64-bit result: (%s@%s) %s\n", entry->host, entry->objoid, result_string);
+	    *result = vars->val.counter64->high;
+	    *result = *result << 32;
+	    *result = *result + vars->val.counter64->low;
+	    break;
+	case ASN_COUNTER:
+	    if (set.verbose >= DEBUG) rtglog("32-bit result: (%s@%s) %s\n", entry->host, entry->objoid, result_string);
+	    *result = (unsigned long) *(vars->val.integer);
+	    break;
+	case ASN_INTEGER:
+	    if (set.verbose >= DEBUG) rtglog("Integer result: (%s@%s) %s\n", entry->host, entry->objoid, result_string);
+	    *result = (unsigned long) *(vars->val.integer);
+	    break;
+	case ASN_GAUGE:
+	    if (set.verbose >= DEBUG) rtglog("32-bit gauge: (%s@%s) %s\n", entry->host, entry->objoid, result_string);
+	    *result = (unsigned long) *(vars->val.integer);
+	    break;
+	case ASN_TIMETICKS:
+	    if (set.verbose >= DEBUG) rtglog("Timeticks result: (%s@%s) %s\n", entry->host, entry->objoid, result_string);
+	    *result = (unsigned long) *(vars->val.integer);
+	    break;
+	case ASN_OPAQUE:
+	    if (set.verbose >= DEBUG) rtglog("Opaque result: (%s@%s) %s\n", entry->host, entry->objoid, result_string);
+	    *result = (unsigned long) *(vars->val.integer);
+	    break;
+	default:
+	    if (set.verbose >= DEBUG) rtglog("Unknown result type: (%s@%s) %s\n", entry->host, entry->objoid, result_string);
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* Process the outcome of one SNMP request for entry, whose value is in
+   vars: count it in worker's shard and hand a good value to
+   process_value().  Shared by every poll engine.  response, which
+   arrived at time received, is not freed. */
+void process_result(worker_t *worker, target_t *entry, int status, struct snmp_pdu *response, struct variable_list *vars, double received)
+{
+    tally_t *tally = count_tally(worker, entry);
+    unsigned long long result = 0;
+    int init = entry->init;
+    int outcome = RESULT_OK;
 
 	/* Collect response and process stats */
-	PT_MUTEX_LOCK(&stats.mutex);
 	if (status == STAT_DESCRIP_ERROR) {
-	    stats.errors++;
-            printf("*** SNMP Error: (%s) Bad descriptor.\n", session.peername);
+	    outcome = RESULT_DESCRIP;
+            rtglog("*** SNMP Error: (%s) Bad descriptor.\n", entry->host);
+	} else if (status == STAT_SKIPPED) {
+	    outcome = RESULT_SKIPPED;
 	} else if (status == STAT_TIMEOUT) {
-	    stats.no_resp++;
-	    printf("*** SNMP No response: (%s@%s).\n", session.peername,
-	       storedoid);
+	    outcome = RESULT_TIMEOUT;
+	    rtglog("*** SNMP No response: (%s@%s).\n", entry->host,
+	       entry->objoid);
 	} else if (status != STAT_SUCCESS) {
-	    stats.errors++;
-	    printf("*** SNMP Error: (%s@%s) Unsuccessuful (%d).\n", session.peername,
-	       storedoid, status);
-	} else if (status == STAT_SUCCESS && response->errstat != SNMP_ERR_NOERROR) {
-	    stats.errors++;
-	    printf("*** SNMP Error: (%s@%s) %s\n", session.peername,
-	       storedoid, snmp_errstring(response->errstat));
-	} else if (status == STAT_SUCCESS && response->errstat == SNMP_ERR_NOERROR) {
-	    stats.polls++;
-	} 
-	PT_MUTEX_UNLOCK(&stats.mutex);
+	    outcome = RESULT_FAILED;
+	    rtglog("*** SNMP Error: (%s@%s) Unsuccessuful (%d).\n", entry->host,
+	       entry->objoid, status);
+	} else if (response->errstat != SNMP_ERR_NOERROR) {
+	    outcome = RESULT_ERRSTAT;
+	    rtglog("*** SNMP Error: (%s@%s) %s\n", entry->host,
+	       entry->objoid, snmp_errstring(response->errstat));
+	} else if (vars == NULL) {
+	    outcome = RESULT_MISSING;
+	    rtglog("*** SNMP Error: (%s@%s) Missing varbind.\n", entry->host,
+	       entry->objoid);
+	} else if (vars->type == SNMP_NOSUCHOBJECT || vars->type == SNMP_NOSUCHINSTANCE ||
+		   vars->type == SNMP_ENDOFMIBVIEW) {
+	    outcome = RESULT_NOSUCH;
+	    rtglog("*** SNMP Error: (%s@%s) %s\n", entry->host, entry->objoid,
+	       vars->type == SNMP_NOSUCHOBJECT ? "No Such Object" :
+	       vars->type == SNMP_NOSUCHINSTANCE ? "No Such Instance" : "End of MIB View");
+	}
+	COUNT(worker->counters->results[outcome], 1);
+	if (outcome == RESULT_OK)
+	    COUNT(tally->polls, 1);
+	else if (outcome == RESULT_TIMEOUT || outcome == RESULT_SKIPPED)
+	    COUNT(tally->no_resp, 1);
+	else
+	    COUNT(tally->errors, 1);
 
 	/* Liftoff, successful poll, process it */
-	if (status == STAT_SUCCESS && response->errstat == SNMP_ERR_NOERROR) {
-	    vars = response->variables;
-#ifdef OLD_UCD_SNMP
-            sprint_value(result_string, anOID, anOID_len, vars);
-#else
-	    snprint_value(result_string, BUFSIZE, anOID, anOID_len, vars);
-#endif
-	    switch (vars->type) {
-		/*
-		 * Switch over vars->type and modify/assign result accordingly.
-		 */
-		case ASN_COUNTER64:
-		    if (set.verbose >= DEBUG) printf("64-bit result: (%s@%s) %s\n", session.peername, storedoid, result_string);
-		    result = vars->val.counter64->high;
-		    result = result << 32;
-		    result = result + vars->val.counter64->low;
-		    break;
-		case ASN_COUNTER:
-		    if (set.verbose >= DEBUG) printf("32-bit result: (%s@%s) %s\n", session.peername, storedoid, result_string);
-		    result = (unsigned long) *(vars->val.integer);
-		    break;
-		case ASN_INTEGER:
-		    if (set.verbose >= DEBUG) printf("Integer result: (%s@%s) %s\n", session.peername, storedoid, result_string);
-		    result = (unsigned long) *(vars->val.integer);
-		    break;
-		case ASN_GAUGE:
-		    if (set.verbose >= DEBUG) printf("32-bit gauge: (%s@%s) %s\n", session.peername, storedoid, result_string);
-		    result = (unsigned long) *(vars->val.integer);
-		    break;
-		case ASN_TIMETICKS:
-		    if (set.verbose >= DEBUG) printf("Timeticks result: (%s@%s) %s\n", session.peername, storedoid, result_string);
-		    result = (unsigned long) *(vars->val.integer);
-		    break;
-		case ASN_OPAQUE:
-		    if (set.verbose >= DEBUG) printf("Opaque result: (%s@%s) %s\n", session.peername, storedoid, result_string);
-		    result = (unsigned long) *(vars->val.integer);
-		    break;
-		default:
-		    if (set.verbose >= DEBUG) printf("Unknown result type: (%s@%s) %s\n", session.peername, storedoid, result_string);
-	    }
+	if (outcome == RESULT_OK) {
+	    snmp_value(entry, vars, &result);
+	    process_value(worker, entry, result, received);
+	}
+
+	if (init == NEW) entry->init = LIVE;
+}
+
+
+/* Compute the delta from a successfully polled target's new value
+   result (handling counter wraps and out of range values), queue it
+   for the database stamped with the time it was received and update
+   the target's last_value */
+void process_value(worker_t *worker, target_t *entry, unsigned long long result, double received)
+{
+    unsigned long long last_value = entry->last_value;
+    unsigned long long insert_val = 0;
+    int bits = entry->bits;
+    int init = entry->init;
 
 		/* Gauge Type */
 		if (bits == 0) {
 			if (result != last_value) {
 				insert_val = result;
 				if (set.verbose >= HIGH)
-					printf("Thread [%d]: Gauge change from %lld to %lld\n", worker->index, last_value, insert_val);
+					rtglog("Thread [%d]: Gauge change from %lld to %lld\n", worker->index, last_value, insert_val);
 			} else {
-				if (set.withzeros) 
+				if (set.withzeros)
 					insert_val = result;
 				if (set.verbose >= HIGH)
-					printf("Thread [%d]: Gauge steady at %lld\n", worker->index, insert_val);
+					rtglog("Thread [%d]: Gauge steady at %lld\n", worker->index, insert_val);
 			}
 	    /* Counter Wrap Condition */
 	    } else if (result < last_value) {
-			PT_MUTEX_LOCK(&stats.mutex);
-              stats.wraps++;
-			PT_MUTEX_UNLOCK(&stats.mutex);
+              COUNT(worker->counters->wraps, 1);
 	      if (bits == 32) insert_val = (THIRTYTWO - last_value) + result;
 	      else if (bits == 64) insert_val = (SIXTYFOUR - last_value) + result;
 	      if (set.verbose >= LOW) {
-	         printf("*** Counter Wrap (%s@%s) [poll: %llu][last: %llu][insert: %llu]\n",
-	         session.peername, storedoid, result, last_value, insert_val);
+	         rtglog("*** Counter Wrap (%s@%s) [poll: %llu][last: %llu][insert: %llu]\n",
+	         entry->host, entry->objoid, result, last_value, insert_val);
 	      }
 	    /* Not a counter wrap and this is not the first poll */
 	    } else if ((last_value >= 0) && (init != NEW)) {
 		insert_val = result - last_value;
 	        /* Print out SNMP result if verbose */
 	        if (set.verbose == DEBUG)
-		  printf("Thread [%d]: (%lld-%lld) = %llu\n", worker->index, result, last_value, insert_val);
+		  rtglog("Thread [%d]: (%lld-%lld) = %llu\n", worker->index, result, last_value, insert_val);
 	        if (set.verbose == HIGH)
-		  printf("Thread [%d]: %llu\n", worker->index, insert_val);
+		  rtglog("Thread [%d]: %llu\n", worker->index, insert_val);
             /* last_value < 0, so this must be the first poll */
 	    } else {
-                if (set.verbose >= HIGH) printf("Thread [%d]: First Poll, Normalizing\n", worker->index);
+                if (set.verbose >= HIGH) rtglog("Thread [%d]: First Poll, Normalizing\n", worker->index);
 	    }
 
 		/* Check for bogus data, either negative or unrealistic */
 	    if (insert_val > entry->maxspeed || result < 0) {
-			if (set.verbose >= LOW) printf("*** Out of Range (%s@%s) [insert_val: %llu] [oor: %lld]\n",
-				session.peername, storedoid, insert_val, entry->maxspeed);
+			if (set.verbose >= LOW) rtglog("*** Out of Range (%s@%s) [insert_val: %llu] [oor: %lld]\n",
+				entry->host, entry->objoid, insert_val, entry->maxspeed);
 			insert_val = 0;
-			PT_MUTEX_LOCK(&stats.mutex);
-			stats.out_of_range++;
-			PT_MUTEX_UNLOCK(&stats.mutex);
+			COUNT(worker->counters->out_of_range, 1);
 	    }
 
+		/* Rows are inserted in batches, see db_queue() */
 		if (!(set.dboff)) {
-			if ( (insert_val > 0) || (set.withzeros) ) {
-				PT_MUTEX_LOCK(&crew->mutex);
-				snprintf(query, sizeof(query), "INSERT INTO %s VALUES (%d, NOW(), %llu)",
-					entry->table, entry->iid, insert_val);
-				if (set.verbose >= DEBUG) printf("SQL: %s\n", query);
-				status = mysql_query(&mysql, query);
-				if (status) printf("*** MySQL Error: %s\n", mysql_error(&mysql));
-				PT_MUTEX_UNLOCK(&crew->mutex);
-
-				if (!status) {
-					PT_MUTEX_LOCK(&stats.mutex);
-					stats.db_inserts++;
-					PT_MUTEX_UNLOCK(&stats.mutex);
-				} 
-			} /* insert_val > 0 or withzeros */	
+			if ( (insert_val > 0) || (set.withzeros) )
+				db_queue(worker, entry, insert_val, received);
 		} /* !dboff */
 
-	} /* STAT_SUCCESS */
+		entry->last_value = result;
+}
 
-        if (sessp != NULL) {
-           snmp_sess_close(sessp);
-           if (response != NULL) snmp_free_pdu(response);
-        }
 
-	if (set.verbose >= DEVELOP)
-	    printf("Thread [%d] locking (update work_count)\n", worker->index);
-	PT_MUTEX_LOCK(&crew->mutex);
-	crew->work_count--;
-	/* Only if we received a positive result back do we update the
-	   last_value object */
-	if (status == STAT_SUCCESS) entry->last_value = result;
-	if (init == NEW) entry->init = LIVE;
-	if (crew->work_count <= 0) {
-	    if (set.verbose >= HIGH) printf("Queue processed. Broadcasting thread done condition.\n");
-		PT_COND_BROAD(&crew->done);
-	}
-	if (set.verbose >= DEVELOP)
-	    printf("Thread [%d] unlocking (update work_count)\n", worker->index);
+/* Account for count targets of one batch whose values the native
+   engine decoded from a response received at time received, and
+   process each value */
+void process_values(worker_t *worker, target_t **targets, int count, unsigned long long *values, double received)
+{
+    tally_t *tally = count_tally(worker, targets[0]);
+    int i;
 
-		PT_MUTEX_UNLOCK(&crew->mutex);
-    }				/* while(1) */
+    COUNT(worker->counters->results[RESULT_OK], count);
+    COUNT(tally->polls, count);
+    for (i = 0; i < count; i++) {
+	if (set.verbose >= DEBUG)
+	    rtglog("Native result: (%s@%s) %llu\n", targets[i]->host, targets[i]->objoid, values[i]);
+	process_value(worker, targets[i], values[i], received);
+	if (targets[i]->init == NEW) targets[i]->init = LIVE;
+    }
 }
@@ -0,0 +1,397 @@
+/****************************************************************************
+   Program:     $Id$
+   Author:      $Author$
+   Date:        $Date$
+   Description: RTG native engine io_uring transport
+****************************************************************************/
+
+#include "common.h"
+#include "rtg.h"
+#include <errno.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The native engine's sends and receives through an io_uring, driven
+   with the raw system calls.  A flush hands the kernel all its queued
+   sendmsgs and waits for them in one io_uring_enter(); answers arrive
+   through a single multishot recvmsg into buffers the kernel picks
+   from a registered ring, so reading them costs no system call at
+   all.  Needs Linux 6.0; on older kernels, or where io_uring is turned
+   off, uring_open() fails and the engine uses its socket directly. */
+
+#define URING_GROUP 0
+#define URING_RECV NATIVE_BATCH		/* user_data of the receive */
+#define URING_BUFSIZE (sizeof(struct io_uring_recvmsg_out) + \
+	sizeof(struct sockaddr_in) + NATIVE_CONTROL + NATIVE_BUFSIZE)
+
+/* The kernel reads and writes the ring indexes concurrently */
+#define URING_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_STORE(p,v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+
+int uring_enter(uring_t *u, unsigned int submit, unsigned int wait)
+{
+    return syscall(__NR_io_uring_enter, u->fd, submit, wait,
+		   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+
+/* The next free submission entry, cleared.  The caller never queues
+   more than the ring holds. */
+struct io_uring_sqe *uring_sqe(uring_t *u)
+{
+    struct io_uring_sqe *sqe = NULL;
+    unsigned int tail = *(u->sq_tail);
+    unsigned int i = tail & *(u->sq_mask);
+
+    sqe = &((struct io_uring_sqe *) u->sqes)[i];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    u->sq_array[i] = i;
+    URING_STORE(u->sq_tail, tail + 1);
+    return sqe;
+}
+
+
+/* Give buffer bid back to the kernel to receive into */
+void uring_recycle(uring_t *u, int bid)
+{
+    struct io_uring_buf_ring *br = (struct io_uring_buf_ring *) u->bufring;
+    struct io_uring_buf *b = &(br->bufs[u->buftail & (URING_BUFFERS - 1)]);
+
+    b->addr = (unsigned long) (u->bufs + bid * URING_BUFSIZE);
+    b->len = URING_BUFSIZE;
+    b->bid = bid;
+    u->buftail++;
+    URING_STORE(&(br->tail), u->buftail);
+}
+
+
+/* Queue the multishot recvmsg.  It stays armed until it runs out of
+   buffers or fails. */
+void uring_arm(uring_t *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->addr = (unsigned long) &(u->msgs[NATIVE_BATCH]);
+    sqe->len = 1;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = URING_RECV;
+    u->armed = TRUE;
+}
+
+
+/* Take the next completion off the ring into cqe, if there is one.
+   It is consumed before it is acted on, so what acting on it does to
+   the ring cannot see it again. */
+int uring_cqe(uring_t *u, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *(u->cq_head);
+
+    if (head == URING_LOAD(u->cq_tail))
+	return FALSE;
+    memcpy(cqe, &((struct io_uring_cqe *) u->cqes)[head & *(u->cq_mask)],
+	   sizeof(struct io_uring_cqe));
+    URING_STORE(u->cq_head, head + 1);
+    return TRUE;
+}
+
+
+/* Note what a completion of the receive says: a datagram to read, or
+   that it has stopped and must be armed again */
+void uring_received(uring_t *u, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+	u->armed = FALSE;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+	u->readybid[u->nready] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	u->readylen[u->nready++] = cqe->res;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && set.verbose >= HIGH) {
+	rtglog("*** Native receive error: %s\n", strerror(-cqe->res));
+    }
+}
+
+
+void uring_close(uring_t *u)
+{
+    if (u->fd >= 0)
+	close(u->fd);
+    if (u->cq_map && u->cq_map != u->sq_map)
+	munmap(u->cq_map, u->cq_maplen);
+    if (u->sq_map)
+	munmap(u->sq_map, u->sq_maplen);
+    if (u->sqes)
+	munmap(u->sqes, u->sqes_len);
+    if (u->bufring)
+	munmap(u->bufring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(u->bufs);
+    free(u->msgs);
+    free(u);
+}
+
+
+/* Set up a ring for a thread's socket sock and arm the receive.
+   Returns NULL, and leaves sock as it was, if the kernel cannot. */
+uring_t *uring_open(int sock)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct io_uring_cqe cqe;
+    uring_t *u = NULL;
+    void *map = NULL;
+    int flags, i;
+
+    u = (uring_t *) calloc(1, sizeof(uring_t));
+    if (!u) {
+	printf("Fatal io_uring malloc error!\n");
+	exit(-1);
+    }
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+	goto fail;
+
+    u->sq_maplen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_maplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (u->cq_maplen > u->sq_maplen)
+	    u->sq_maplen = u->cq_maplen;
+	u->cq_maplen = u->sq_maplen;
+    }
+    map = mmap(NULL, u->sq_maplen, PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+	goto fail;
+    u->sq_map = u->cq_map = map;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+	map = mmap(NULL, u->cq_maplen, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	if (map == MAP_FAILED) {
+	    u->cq_map = NULL;
+	    goto fail;
+	}
+	u->cq_map = map;
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+	goto fail;
+    u->sqes = map;
+    u->sq_head = (unsigned int *) ((char *) u->sq_map + p.sq_off.head);
+    u->sq_tail = (unsigned int *) ((char *) u->sq_map + p.sq_off.tail);
+    u->sq_mask = (unsigned int *) ((char *) u->sq_map + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *) ((char *) u->sq_map + p.sq_off.array);
+    u->cq_head = (unsigned int *) ((char *) u->cq_map + p.cq_off.head);
+    u->cq_tail = (unsigned int *) ((char *) u->cq_map + p.cq_off.tail);
+    u->cq_mask = (unsigned int *) ((char *) u->cq_map + p.cq_off.ring_mask);
+    u->cqes = (char *) u->cq_map + p.cq_off.cqes;
+
+    /* The socket as fixed file 0, and the receive buffers */
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, &sock, 1) < 0)
+	goto fail;
+    map = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+	goto fail;
+    u->bufring = map;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) u->bufring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	goto fail;
+    /* Only the pages datagrams are read into get touched */
+    u->bufs = (u_char *) malloc(URING_BUFFERS * URING_BUFSIZE);
+    u->msgs = (struct msghdr *) calloc(NATIVE_BATCH + 1, sizeof(struct msghdr));
+    if (!u->bufs || !u->msgs) {
+	printf("Fatal io_uring malloc error!\n");
+	exit(-1);
+    }
+    for (i = 0; i < URING_BUFFERS; i++)
+	uring_recycle(u, i);
+
+    /* Each buffer gets the source address, the drop count and the
+       arrival time ahead of the datagram */
+    u->msgs[NATIVE_BATCH].msg_namelen = sizeof(struct sockaddr_in);
+    u->msgs[NATIVE_BATCH].msg_controllen = NATIVE_CONTROL;
+
+    /* The ring waits for the socket itself; a non-blocking one would
+       have it give up on an empty queue instead */
+    flags = fcntl(sock, F_GETFL);
+    fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    uring_arm(u);
+    if (uring_enter(u, 1, 0) != 1) {
+	fcntl(sock, F_SETFL, flags);
+	goto fail;
+    }
+    /* A kernel without multishot receives fails it straight away */
+    if (uring_cqe(u, &cqe) && cqe.res < 0) {
+	errno = -cqe.res;
+	fcntl(sock, F_SETFL, flags);
+	goto fail;
+    }
+    if (set.verbose >= HIGH)
+	rtglog("Native engine using io_uring (%u entries).\n", p.sq_entries);
+    return u;
+
+  fail:
+    if (set.verbose >= LOW)
+	rtglog("*** io_uring unavailable (%s), using socket I/O.\n", strerror(errno));
+    uring_close(u);
+    return NULL;
+}
+
+
+/* Send the nout queued requests and wait until the kernel is done
+   with them, since their buffer is reused as soon as we return.
+   Sets err[i] to 0, or why the ith could not be sent.  Returns how
+   many were sent. */
+int uring_send(native_t *n, int nout, int *err)
+{
+    uring_t *u = n->uring;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe cqe;
+    struct msghdr *msg = NULL;
+    int submitted, done, i;
+    int sent = 0;
+
+    for (i = 0; i < nout; i++) {
+	msg = &(u->msgs[i]);
+	memset(msg, 0, sizeof(struct msghdr));
+	msg->msg_name = &(n->outreq[i]->batch->device->addr);
+	msg->msg_namelen = sizeof(struct sockaddr_in);
+	msg->msg_iov = &(n->outiov[i]);
+	msg->msg_iovlen = 1;
+	sqe = uring_sqe(u);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (unsigned long) msg;
+	sqe->len = 1;
+	sqe->user_data = i;
+	err[i] = EAGAIN;
+    }
+
+    submitted = uring_enter(u, nout, nout);
+    if (submitted < 0)
+	submitted = 0;
+    if (submitted < nout) {
+	/* Take back what the kernel did not; those are retried by
+	   their timers like any other send that failed for now */
+	URING_STORE(u->sq_tail, URING_LOAD(u->sq_head));
+	if (set.verbose >= HIGH)
+	    rtglog("*** io_uring took %d of %d sends: %s\n", submitted, nout, strerror(errno));
+    }
+
+    for (done = 0; done < submitted;) {
+	if (!uring_cqe(u, &cqe)) {
+	    if (uring_enter(u, 0, 1) < 0 && errno != EINTR) {
+		printf("Fatal io_uring wait error: %s\n", strerror(errno));
+		exit(-1);
+	    }
+	    continue;
+	}
+	if (cqe.user_data == URING_RECV) {
+	    uring_received(u, &cqe);
+	} else {
+	    err[cqe.user_data] = cqe.res < 0 ? -cqe.res : 0;
+	    if (cqe.res >= 0)
+		sent++;
+	    done++;
+	}
+    }
+    return sent;
+}
+
+
+/* Process the datagrams received since last time.  Returns how many
+   there were. */
+int uring_drain(native_t *n)
+{
+    uring_t *u = n->uring;
+    struct io_uring_recvmsg_out *out = NULL;
+    struct io_uring_cqe cqe;
+    struct msghdr *tmpl = &(u->msgs[NATIVE_BATCH]);
+    struct msghdr ctl;
+    struct sockaddr_in from;
+    unsigned int drops = n->drops;
+    double received;
+    u_char *buf = NULL;
+    u_char *name = NULL;
+    int count = 0;
+    int bid, len;
+
+    while (uring_cqe(u, &cqe)) {
+	if (cqe.user_data == URING_RECV)
+	    uring_received(u, &cqe);
+    }
+
+    /* Handling one may flush, which can leave more in ready[] */
+    while (u->nready > 0) {
+	bid = u->readybid[--(u->nready)];
+	len = u->readylen[u->nready];
+	buf = u->bufs + bid * URING_BUFSIZE;
+	out = (struct io_uring_recvmsg_out *) buf;
+	name = buf + sizeof(struct io_uring_recvmsg_out);
+	if (len < (int) (sizeof(struct io_uring_recvmsg_out) + tmpl->msg_namelen + tmpl->msg_controllen) ||
+	    out->payloadlen > NATIVE_BUFSIZE) {
+	    uring_recycle(u, bid);
+	    continue;
+	}
+	count++;
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.msg_control = name + tmpl->msg_namelen;
+	ctl.msg_controllen = out->controllen;
+	native_control(&ctl, &drops, &received);
+	memset(&from, 0, sizeof(from));
+	memcpy(&from, name, out->namelen < sizeof(from) ? out->namelen : sizeof(from));
+	native_receive(n, name + tmpl->msg_namelen + tmpl->msg_controllen,
+		       out->payloadlen, &from, received);
+	uring_recycle(u, bid);
+    }
+
+    if (!u->armed) {
+	uring_arm(u);
+	if (uring_enter(u, 1, 0) != 1) {
+	    printf("Fatal io_uring receive error: %s\n", strerror(errno));
+	    exit(-1);
+	}
+    }
+    if (count > 0)
+	native_count(n, count, drops);
+    return count;
+}
+
+#else				/* HAVE_LINUX_IO_URING_H */
+
+uring_t *uring_open(int sock)
+{
+    if (set.verbose >= LOW)
+	rtglog("*** Built without io_uring, using socket I/O.\n");
+    return NULL;
+}
+
+void uring_close(uring_t *u)
+{
+}
+
+int uring_send(native_t *n, int nout, int *err)
+{
+    return 0;
+}
+
+int uring_drain(native_t *n)
+{
+    return 0;
+}
+
+#endif				/* HAVE_LINUX_IO_URING_H */
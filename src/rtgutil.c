@@ -7,8 +7,10 @@
 
 #include "common.h"
 #include "rtg.h"
+#include <errno.h>
 
 extern FILE *dfp;
+extern stats_t stats;
 
 /* read configuration file to establish local environment */
 int read_rtg_config(char *file, config_t * set)
@@ -29,14 +31,66 @@ int read_rtg_config(char *file, config_t * set)
               sscanf(buff, "%20s %20s", p1, p2);
               if (!strcasecmp(p1, "Interval")) set->interval = atoi(p2);
               else if (!strcasecmp(p1, "HighSkewSlop")) set->highskewslop = atof(p2);
+              else if (!strcasecmp(p1, "Spread")) set->spread = atof(p2);
+              else if (!strcasecmp(p1, "LongestFirst")) set->longest_first = atoi(p2);
               else if (!strcasecmp(p1, "LowSkewSlop")) set->lowskewslop = atof(p2);
+              /* A log file path may be longer than p2 */
+              else if (!strcasecmp(p1, "Log")) sscanf(buff, "%*s %511s", set->log);
+              else if (!strcasecmp(p1, "LogRate")) set->log_rate = atoi(p2);
               else if (!strcasecmp(p1, "SNMP_Ver")) set->snmp_ver = atoi(p2);
               else if (!strcasecmp(p1, "SNMP_Port")) set->snmp_port = atoi(p2);
               else if (!strcasecmp(p1, "Threads")) set->threads = atoi(p2);
+              else if (!strcasecmp(p1, "ThreadsMin")) set->threads_min = atoi(p2);
+              else if (!strcasecmp(p1, "ThreadsMax")) set->threads_max = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_Engine")) {
+                 if (!strcasecmp(p2, "sync")) set->engine = SYNC;
+                 else if (!strcasecmp(p2, "async")) set->engine = ASYNC;
+                 else if (!strcasecmp(p2, "native")) set->engine = NATIVE;
+                 else {
+                    fprintf(dfp, "*** Unsupported SNMP engine: %s.\n", p2);
+                    exit(-1);
+                 }
+              }
+              else if (!strcasecmp(p1, "SNMP_Window")) set->window = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_MaxOIDs")) set->max_oids = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_MaxPDU")) set->max_pdu = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_MaxReps")) set->max_reps = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_DevInflight")) set->dev_inflight = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_DevGap")) set->dev_gap = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_Sessions")) set->sessions = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_Timeout")) set->timeout = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_MinTimeout")) set->min_timeout = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_Retries")) set->retries = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_FailLimit")) set->fail_limit = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_SndBuf")) set->sndbuf = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_RcvBuf")) set->rcvbuf = atoi(p2);
+              else if (!strcasecmp(p1, "SNMP_IO")) {
+                 if (!strcasecmp(p2, "socket")) set->io = SOCKET_IO;
+                 else if (!strcasecmp(p2, "uring")) set->io = URING_IO;
+                 else {
+                    fprintf(dfp, "*** Unsupported SNMP I/O: %s.\n", p2);
+                    exit(-1);
+                 }
+              }
               else if (!strcasecmp(p1, "DB_Host")) strncpy(set->dbhost, p2, sizeof(set->dbhost));
               else if (!strcasecmp(p1, "DB_Database")) strncpy(set->dbdb, p2, sizeof(set->dbdb));
               else if (!strcasecmp(p1, "DB_User")) strncpy(set->dbuser, p2, sizeof(set->dbuser));
               else if (!strcasecmp(p1, "DB_Pass")) strncpy(set->dbpass, p2, sizeof(set->dbpass));
+              else if (!strcasecmp(p1, "DB_SubSecond")) set->dbsubsecond = atoi(p2);
+              else if (!strcasecmp(p1, "DB_BatchRows")) set->db_batch_rows = atoi(p2);
+              else if (!strcasecmp(p1, "DB_BatchBytes")) set->db_batch_bytes = atoi(p2);
+              else if (!strcasecmp(p1, "DB_BatchAge")) set->db_batch_age = atoi(p2);
+              else if (!strcasecmp(p1, "DB_Writers")) set->db_writers = atoi(p2);
+              else if (!strcasecmp(p1, "DB_Queue")) set->db_queue = atoi(p2);
+              else if (!strcasecmp(p1, "DB_Mode")) {
+                 if (!strcasecmp(p2, "insert")) set->db_mode = DB_INSERT;
+                 else if (!strcasecmp(p2, "prepared")) set->db_mode = DB_PREPARED;
+                 else if (!strcasecmp(p2, "load")) set->db_mode = DB_LOAD;
+                 else {
+                    fprintf(dfp, "*** Unsupported DB mode: %s.\n", p2);
+                    exit(-1);
+                 }
+              }
 
 /* Long longs not ANSI C.  If OS doesn't support atoll() use default. */
               else if (!strcasecmp(p1, "OutOfRange")) 
@@ -54,13 +108,67 @@ int read_rtg_config(char *file, config_t * set)
            }
         }
 
+        if ((int) set->interval < 1) {
+          fprintf(dfp, "*** Invalid Interval: %d.\n", (int) set->interval);
+          exit(-1);
+        }
         if (set->snmp_ver != 1 && set->snmp_ver != 2) {
           fprintf(dfp, "*** Unsupported SNMP version: %d.\n", set->snmp_ver);
           exit(-1);
         }
-        if (set->threads < 1 || set->threads > MAX_THREADS) {
-          fprintf(dfp, "*** Invalid Number of Threads: %d (max=%d).\n", 
-             set->threads, MAX_THREADS);
+        if (set->threads < 1) {
+          fprintf(dfp, "*** Invalid Number of Threads: %d.\n", set->threads);
+          exit(-1);
+        }
+        if (set->threads_max) {
+          if (set->threads_min == 0) set->threads_min = 1;
+          if (set->threads_min < 1 || set->threads_min > set->threads_max) {
+            fprintf(dfp, "*** Invalid ThreadsMin/ThreadsMax: %d/%d.\n", 
+               set->threads_min, set->threads_max);
+            exit(-1);
+          }
+          if (set->threads < set->threads_min) set->threads = set->threads_min;
+          if (set->threads > set->threads_max) set->threads = set->threads_max;
+        }
+        if (set->max_oids < 1 || set->max_oids > MAX_OIDS) {
+          fprintf(dfp, "*** Invalid SNMP MaxOIDs: %d (max=%d).\n", 
+             set->max_oids, MAX_OIDS);
+          exit(-1);
+        }
+        if (set->spread < 0 || set->spread >= 1) {
+          fprintf(dfp, "*** Invalid Spread: %f (must be below 1).\n", set->spread);
+          exit(-1);
+        }
+        if (set->max_reps > MAX_REPS) {
+          fprintf(dfp, "*** Invalid SNMP MaxReps: %d (max=%d).\n", 
+             set->max_reps, MAX_REPS);
+          exit(-1);
+        }
+        if (set->timeout < 1 || set->min_timeout > set->timeout) {
+          fprintf(dfp, "*** Invalid SNMP_MinTimeout/SNMP_Timeout: %d/%d.\n",
+             set->min_timeout, set->timeout);
+          exit(-1);
+        }
+        if (set->db_batch_rows < 1) {
+          fprintf(dfp, "*** Invalid DB_BatchRows: %d.\n", set->db_batch_rows);
+          exit(-1);
+        }
+        if (set->db_mode == DB_PREPARED && set->db_batch_rows > DB_STMT_ROWS) {
+          fprintf(dfp, "*** Invalid DB_BatchRows: %d (max=%d prepared).\n",
+             set->db_batch_rows, DB_STMT_ROWS);
+          exit(-1);
+        }
+        if (set->db_writers < 1) {
+          fprintf(dfp, "*** Invalid DB_Writers: %d.\n", set->db_writers);
+          exit(-1);
+        }
+        if (set->db_queue < 1) {
+          fprintf(dfp, "*** Invalid DB_Queue: %d.\n", set->db_queue);
+          exit(-1);
+        }
+        if (set->window < 1 || set->window > MAX_WINDOW) {
+          fprintf(dfp, "*** Invalid SNMP Window: %d (max=%d).\n", 
+             set->window, MAX_WINDOW);
           exit(-1);
         }
         return (0);
@@ -80,16 +188,46 @@ int write_rtg_config(char *file, config_t * set)
     } else {
         fprintf(fp, "#\n# RTG v%s Master Config\n#\n", VERSION);
         fprintf(fp, "Interval\t%d\n", set->interval);
+        fprintf(fp, "Spread\t%f\n", set->spread);
+        fprintf(fp, "LongestFirst\t%d\n", set->longest_first);
         fprintf(fp, "HighSkewSlop\t%f\n", set->highskewslop);
         fprintf(fp, "LowSkewSlop\t%f\n", set->lowskewslop);
+        fprintf(fp, "Log\t%s\n", set->log);
+        fprintf(fp, "LogRate\t%d\n", set->log_rate);
         fprintf(fp, "OutOfRange\t%lld\n", set->out_of_range);
         fprintf(fp, "SNMP_Ver\t%d\n", set->snmp_ver);
         fprintf(fp, "SNMP_Port\t%d\n", set->snmp_port);
+        fprintf(fp, "SNMP_Engine\t%s\n", set->engine == NATIVE ? "native" :
+            set->engine == ASYNC ? "async" : "sync");
+        fprintf(fp, "SNMP_Window\t%d\n", set->window);
+        fprintf(fp, "SNMP_MaxOIDs\t%d\n", set->max_oids);
+        fprintf(fp, "SNMP_MaxPDU\t%d\n", set->max_pdu);
+        fprintf(fp, "SNMP_MaxReps\t%d\n", set->max_reps);
+        fprintf(fp, "SNMP_DevInflight\t%d\n", set->dev_inflight);
+        fprintf(fp, "SNMP_DevGap\t%d\n", set->dev_gap);
+        fprintf(fp, "SNMP_Sessions\t%d\n", set->sessions);
+        fprintf(fp, "SNMP_Timeout\t%d\n", set->timeout);
+        fprintf(fp, "SNMP_MinTimeout\t%d\n", set->min_timeout);
+        fprintf(fp, "SNMP_Retries\t%d\n", set->retries);
+        fprintf(fp, "SNMP_FailLimit\t%d\n", set->fail_limit);
+        fprintf(fp, "SNMP_SndBuf\t%d\n", set->sndbuf);
+        fprintf(fp, "SNMP_RcvBuf\t%d\n", set->rcvbuf);
+        fprintf(fp, "SNMP_IO\t%s\n", set->io == URING_IO ? "uring" : "socket");
         fprintf(fp, "DB_Host\t%s\n", set->dbhost);
         fprintf(fp, "DB_Database\t%s\n", set->dbdb);
         fprintf(fp, "DB_User\t%s\n", set->dbuser);
         fprintf(fp, "DB_Pass\t%s\n", set->dbpass);
+        fprintf(fp, "DB_SubSecond\t%d\n", set->dbsubsecond);
+        fprintf(fp, "DB_BatchRows\t%d\n", set->db_batch_rows);
+        fprintf(fp, "DB_BatchBytes\t%d\n", set->db_batch_bytes);
+        fprintf(fp, "DB_BatchAge\t%d\n", set->db_batch_age);
+        fprintf(fp, "DB_Writers\t%d\n", set->db_writers);
+        fprintf(fp, "DB_Queue\t%d\n", set->db_queue);
+        fprintf(fp, "DB_Mode\t%s\n", set->db_mode == DB_LOAD ? "load" :
+            set->db_mode == DB_PREPARED ? "prepared" : "insert");
         fprintf(fp, "Threads\t%d\n", set->threads);
+        fprintf(fp, "ThreadsMin\t%d\n", set->threads_min);
+        fprintf(fp, "ThreadsMax\t%d\n", set->threads_max);
         fclose(fp);
         return (0);
     }
@@ -101,15 +239,43 @@ void config_defaults(config_t * set)
 {
    set->interval = DEFAULT_INTERVAL;
    set->highskewslop = DEFAULT_HIGHSKEWSLOP;
+   set->spread = DEFAULT_SPREAD;
+   set->longest_first = DEFAULT_LONGEST_FIRST;
    set->lowskewslop = DEFAULT_LOWSKEWSLOP;
+   strncpy(set->log, DEFAULT_LOG, sizeof(set->log));
+   set->log_rate = DEFAULT_LOG_RATE;
    set->out_of_range = DEFAULT_OUT_OF_RANGE;
    set->snmp_ver = DEFAULT_SNMP_VER;
    set->snmp_port = DEFAULT_SNMP_PORT;
    set->threads = DEFAULT_THREADS;
+   set->threads_min = DEFAULT_THREADS_MIN;
+   set->threads_max = DEFAULT_THREADS_MAX;
+   set->engine = DEFAULT_ENGINE;
+   set->window = DEFAULT_WINDOW;
+   set->max_oids = DEFAULT_MAX_OIDS;
+   set->max_pdu = DEFAULT_MAX_PDU;
+   set->max_reps = DEFAULT_MAX_REPS;
+   set->dev_inflight = DEFAULT_DEV_INFLIGHT;
+   set->dev_gap = DEFAULT_DEV_GAP;
+   set->sessions = DEFAULT_SESSIONS;
+   set->timeout = DEFAULT_TIMEOUT;
+   set->min_timeout = DEFAULT_MIN_TIMEOUT;
+   set->retries = DEFAULT_RETRIES;
+   set->fail_limit = DEFAULT_FAIL_LIMIT;
+   set->sndbuf = DEFAULT_SNDBUF;
+   set->rcvbuf = DEFAULT_RCVBUF;
+   set->io = DEFAULT_IO;
    strncpy(set->dbhost, DEFAULT_DB_HOST, sizeof(set->dbhost));
    strncpy(set->dbdb, DEFAULT_DB_DB, sizeof(set->dbhost));
    strncpy(set->dbuser, DEFAULT_DB_USER, sizeof(set->dbhost));
    strncpy(set->dbpass, DEFAULT_DB_PASS, sizeof(set->dbhost));
+   set->dbsubsecond = DEFAULT_DB_SUBSECOND;
+   set->db_batch_rows = DEFAULT_DB_BATCH_ROWS;
+   set->db_batch_bytes = DEFAULT_DB_BATCH_BYTES;
+   set->db_batch_age = DEFAULT_DB_BATCH_AGE;
+   set->db_writers = DEFAULT_DB_WRITERS;
+   set->db_queue = DEFAULT_DB_QUEUE;
+   set->db_mode = DEFAULT_DB_MODE;
    set->dboff = FALSE;
    set->withzeros = FALSE;
    set->verbose = OFF; 
@@ -120,24 +286,253 @@ void config_defaults(config_t * set)
 }
 
 
-/* Print RTG stats */
+/* Print RTG stats, summing the shards as they stand */
 void print_stats(stats_t stats)
 {
-  printf("\n[Polls = %lld] [DBInserts = %lld] [Wraps = %d] [OutOfRange = %d]\n",
-      stats.polls, stats.db_inserts, stats.wraps, stats.out_of_range);
-  printf("[No Resp = %d] [SNMP Errs = %d] [Slow = %d] [PollTime = %2.3f%c]\n",
-      stats.no_resp, stats.errors, stats.slow, stats.poll_time, 's');
+  counters_t total;
+  iclass_t *c = NULL;
+  tally_t t;
+  unsigned long long *r = total.results;
+  int i, j;
+
+  counters_sum(&total);
+  printf("\n[Polls = %llu] [DBInserts = %llu] [Wraps = %llu] [OutOfRange = %llu]\n",
+      r[RESULT_OK], total.db_inserts, total.wraps, total.out_of_range);
+  printf("[No Resp = %llu] [SNMP Errs = %llu] [Slow = %d] [PollTime = %2.3f%c]\n",
+      r[RESULT_TIMEOUT] + r[RESULT_SKIPPED],
+      r[RESULT_DESCRIP] + r[RESULT_FAILED] + r[RESULT_ERRSTAT] + r[RESULT_MISSING] + r[RESULT_NOSUCH],
+      stats.slow, stats.poll_time, 's');
+  /* How far behind schedule the round got, and what it cut off */
+  printf("[Late = %2.3f%c] [Abandoned = %llu] [Stragglers = %llu]\n",
+      stats.late, 's', stats.abandoned + total.abandoned, total.stragglers);
+  /* How long rounds take on average, against the longest device's
+     expected share of the last one, which no order can beat */
+  printf("[AvgPollTime = %2.3f%c] [LongestJob = %2.3f%c]\n",
+      stats.round ? stats.total_time / stats.round : 0, 's', stats.longest, 's');
+  /* The two totals above, broken down */
+  printf("[Timeouts = %llu] [Skipped = %llu] [Retries = %llu] [ErrStatus = %llu] [NoSuch = %llu] [Other Errs = %llu]\n",
+      r[RESULT_TIMEOUT], r[RESULT_SKIPPED], total.retries, r[RESULT_ERRSTAT], r[RESULT_NOSUCH],
+      r[RESULT_DESCRIP] + r[RESULT_FAILED] + r[RESULT_MISSING]);
+  /* Thread time, summed over the threads */
+  printf("[SNMP Wait = %2.3f%c] [DB Time = %2.3f%c] [Idle = %2.3f%c]\n",
+      total.usecs[PHASE_SNMP] / 1000000.0, 's', total.usecs[PHASE_DB] / 1000000.0, 's',
+      total.usecs[PHASE_IDLE] / 1000000.0, 's');
+  /* Batches waiting on the database writers, now and at most, and what
+     the writers got through since the last round, to compare DB_Modes */
+  if (!set.dboff) {
+    printf("[DB Queue = %d] [DB Queue Peak = %d] [DB Dropped = %llu]\n",
+        stats.db_depth, stats.db_peak, total.db_dropped);
+    printf("[DB Mode = %s] [DB Rows = %llu] [DB Write Time = %2.3f%c] [DB Rows/s = %.0f]\n",
+        set.db_mode == DB_LOAD ? "load" : set.db_mode == DB_PREPARED ? "prepared" : "insert",
+        stats.db_rows, stats.db_time, 's', stats.db_time > 0 ? stats.db_rows / stats.db_time : 0);
+  }
+  /* Responses lost before they reached us, not on the network */
+  if (set.engine == NATIVE)
+    printf("[Sent = %llu] [Received = %llu] [Bytes Out = %llu] [Bytes In = %llu] [RcvBuf Drops = %llu]\n",
+        total.sent, total.received, total.bytes_sent, total.bytes_received, total.drops);
+  /* Break the totals down when targets are polled at several intervals */
+  for (i = 0; hash.nclasses > 1 && i < hash.nclasses; i++) {
+    c = &(hash.classes[i]);
+    t.polls = c->polls;
+    t.db_inserts = c->db_inserts;
+    t.no_resp = c->no_resp;
+    t.errors = c->errors;
+    for (j = 0; j < stats.nshards; j++) {
+      if (i >= stats.shards[j]->ntally)
+        continue;
+      t.polls += COUNTED(stats.shards[j]->tally[i].polls);
+      t.db_inserts += COUNTED(stats.shards[j]->tally[i].db_inserts);
+      t.no_resp += COUNTED(stats.shards[j]->tally[i].no_resp);
+      t.errors += COUNTED(stats.shards[j]->tally[i].errors);
+    }
+    printf("[Interval %us: Targets = %d] [Rounds = %d] [Polls = %llu] [DBInserts = %llu] [No Resp = %llu] [SNMP Errs = %llu]\n",
+        c->interval, c->ntargets, c->rounds, t.polls, t.db_inserts, t.no_resp, t.errors);
+  }
   return;
 }
 
 
-/* A fancy sleep routine */
-void sleepy(float sleep_time)
+/* Start a statistics shard, with a tally for each interval class.  A
+   shard has cache lines of its own and is never freed.  Only called by
+   main(), with reload_mutex held once threads are running. */
+counters_t *counters_new()
+{
+  counters_t **shards = NULL;
+  counters_t *shard = NULL;
+  char *p = NULL;
+
+  shards = (counters_t **) realloc(stats.shards, (stats.nshards + 1) * sizeof(counters_t *));
+  p = (char *) malloc(sizeof(counters_t) + CACHE_LINE);
+  if (!shards || !p) {
+    printf("Fatal stats malloc error!\n");
+    exit(-1);
+  }
+  stats.shards = shards;
+  shard = (counters_t *) (p + CACHE_LINE - (unsigned long) p % CACHE_LINE);
+  memset(shard, 0, sizeof(counters_t));
+  shard->tally = (tally_t *) calloc(hash.nclasses + 1, sizeof(tally_t));
+  if (!shard->tally) {
+    printf("Fatal stats malloc error!\n");
+    exit(-1);
+  }
+  shard->ntally = hash.nclasses;
+  stats.shards[stats.nshards++] = shard;
+  return shard;
+}
+
+
+/* Return the statistics shard of worker index, starting one if there
+   is none yet.  Only called by main(), as counters_new(). */
+counters_t *counters_get(int index)
+{
+  counters_t **workers = NULL;
+
+  while (stats.nworkers <= index) {
+    workers = (counters_t **) realloc(stats.workers, (stats.nworkers + 1) * sizeof(counters_t *));
+    if (!workers) {
+      printf("Fatal stats malloc error!\n");
+      exit(-1);
+    }
+    stats.workers = workers;
+    stats.workers[stats.nworkers++] = counters_new();
+  }
+  return stats.workers[index];
+}
+
+
+/* Sum every shard into total, without stopping the workers; each count
+   is as the worker last left it */
+void counters_sum(counters_t *total)
+{
+  counters_t *shard = NULL;
+  int i, j;
+
+  memset(total, 0, sizeof(counters_t));
+  for (i = 0; i < stats.nshards; i++) {
+    shard = stats.shards[i];
+    for (j = 0; j < RESULTS; j++)
+      total->results[j] += COUNTED(shard->results[j]);
+    for (j = 0; j < PHASES; j++)
+      total->usecs[j] += COUNTED(shard->usecs[j]);
+    total->db_inserts += COUNTED(shard->db_inserts);
+    total->db_dropped += COUNTED(shard->db_dropped);
+    total->wraps += COUNTED(shard->wraps);
+    total->out_of_range += COUNTED(shard->out_of_range);
+    total->abandoned += COUNTED(shard->abandoned);
+    total->stragglers += COUNTED(shard->stragglers);
+    total->sent += COUNTED(shard->sent);
+    total->received += COUNTED(shard->received);
+    total->drops += COUNTED(shard->drops);
+    total->bytes_sent += COUNTED(shard->bytes_sent);
+    total->bytes_received += COUNTED(shard->bytes_received);
+    total->retries += COUNTED(shard->retries);
+  }
+}
+
+
+/* Add the shards' tallies to the nold interval classes they were kept
+   for, and start them afresh for the hash.nclasses classes there are
+   now.  Only called on a reload, while every worker is idle. */
+void counters_fold(iclass_t *old, int nold)
+{
+  counters_t *shard = NULL;
+  int i, j;
+
+  for (i = 0; i < stats.nshards; i++) {
+    shard = stats.shards[i];
+    for (j = 0; j < nold && j < shard->ntally; j++) {
+      old[j].polls += shard->tally[j].polls;
+      old[j].db_inserts += shard->tally[j].db_inserts;
+      old[j].no_resp += shard->tally[j].no_resp;
+      old[j].errors += shard->tally[j].errors;
+    }
+    free(shard->tally);
+    shard->tally = (tally_t *) calloc(hash.nclasses + 1, sizeof(tally_t));
+    if (!shard->tally) {
+      printf("Fatal stats malloc error!\n");
+      exit(-1);
+    }
+    shard->ntally = hash.nclasses;
+  }
+}
+
+
+/* The tally in worker's shard for entry's interval class */
+tally_t *count_tally(worker_t *worker, target_t *entry)
+{
+  return &(worker->counters->tally[entry->iclass - hash.classes]);
+}
+
+
+/* Add the time since since to what worker has spent in phase */
+void count_time(worker_t *worker, int phase, double since)
+{
+  double now = time_now();
+
+  if (now > since)
+    COUNT(worker->counters->usecs[phase], (unsigned long long) ((now - since) * 1000000));
+}
+
+
+double time_now() {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return ((double) now.tv_usec / 1000000 + now.tv_sec);
+}
+
+
+/* Seconds on a clock that only moves forward, for round deadlines;
+   without clock_nanosleep() that is just the time of day */
+double clock_now() {
+#ifdef HAVE_CLOCK_NANOSLEEP
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double) now.tv_nsec / 1000000000 + now.tv_sec);
+#else
+    return time_now();
+#endif
+}
+
+
+/* When, in clock_now() terms, the time of day next reaches a multiple
+   of tick seconds */
+double next_boundary(unsigned int tick) {
+    double wall = time_now();
+    time_t boundary = ((time_t) wall / tick + 1) * tick;
+
+    return clock_now() + (boundary - wall);
+}
+
+
+/* Sleep until clock_now() reaches deadline */
+void nap_until(double deadline) {
+#ifdef HAVE_CLOCK_NANOSLEEP
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) deadline;
+    ts.tv_nsec = (long) ((deadline - ts.tv_sec) * 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	;
+#else
+    double nap;
+
+    while ((nap = deadline - clock_now()) > 0)
+	usleep((unsigned int) (nap * 1000000));
+#endif
+}
+
+
+/* A fancy sleep routine.  Every step ends at a fixed time, so however
+   long the printing takes the sleep ends at deadline. */
+void sleep_until(double deadline)
 {
+    double start = clock_now();
     int chunks = 10;
     int i;
 
-	if (sleep_time > chunks) {
+	if (deadline - start > chunks) {
 		if (set.verbose >= LOW)
 			printf("Next Poll: ");
 		for (i = chunks; i > 0; i--) {
@@ -145,12 +540,11 @@ void sleepy(float sleep_time)
 				printf("%d...", i);
 				fflush(NULL);
 			}
-			usleep((unsigned int) (sleep_time*1000000 / chunks));
+			nap_until(deadline - (deadline - start) * (i - 1) / chunks);
 		}
 		if (set.verbose >= LOW) printf("\n");
 	} else {
-		sleep_time*=1000000;
-		usleep((unsigned int) sleep_time);
+		nap_until(deadline);
 	}
 }
 
@@ -222,6 +616,43 @@ int checkPID(char *pidfile) {
 	}
 }
 
+/* Autoscaling: pick a thread count that should bring the part of the
+   last round's poll_time past its last spread offset to about half of
+   what is left of the time between rounds.  Left alone while it takes
+   between a quarter and three quarters of that; changes at most by a
+   factor of two per round.  Only called for the sync engine, the one
+   whose round time scales with the number of threads. */
+int scale_threads(int threads, double poll_time) {
+    double span = hash.tick * (1 - set.spread);
+    double tail = poll_time - hash.tick * set.spread;
+    double want;
+
+    if (tail < 0) tail = 0;
+    if (tail > span * 0.75 || tail < span * 0.25) {
+        want = threads * tail / (span * 0.5);
+        if (want > threads * 2) want = threads * 2;
+        if (want < threads / 2) want = threads / 2;
+        threads = (int) (want + 0.5);
+    }
+    if (threads < set.threads_min) threads = set.threads_min;
+    if (threads > set.threads_max) threads = set.threads_max;
+    return threads;
+}
+
+
+/* Stand-in for __sync_fetch_and_add() */
+int atomic_add(int *x, int n) {
+    static pthread_mutex_t atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+    int old;
+
+    PT_MUTEX_LOCK(&atomic_mutex);
+    old = *x;
+    *x += n;
+    PT_MUTEX_UNLOCK(&atomic_mutex);
+    return old;
+}
+
+
 int alldigits(char *s) {
     int result = TRUE;
 